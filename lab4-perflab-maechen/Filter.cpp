@@ -1,11 +1,69 @@
 #include "Filter.h"
 #include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+//
+// Layout of a .cfilter file: this header followed by dim * dim taps.
+// The checksum covers the header (with checksum = 0) and the taps.
+//
+#define CFILTER_MAGIC "CFLT"
+#define CFILTER_VERSION 2
+
+struct CompiledFilterHeader {
+  char magic[4];
+  unsigned short version;
+  short dim;
+  short divisor;
+  unsigned char separable;
+  unsigned char type;       // FilterType
+  unsigned char pad[4];
+  short rowTaps[FILTER_DIM];
+  short colTaps[FILTER_DIM];
+  int maxAbsSum;
+  int shift;
+  unsigned long long mul;
+  unsigned int checksum;
+};
+
+//
+// FNV-1a over a byte range
+//
+static unsigned int checksum(const void *buf, size_t len, unsigned int hash)
+{
+  const unsigned char *p = (const unsigned char *) buf;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int gcd(int a, int b)
+{
+  a = abs(a);
+  b = abs(b);
+  while (b) {
+    int t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
 
 Filter::Filter(short _dim)
 {
+  type = FILTER_CONVOLVE;
   divisor = 1;
   dim = _dim;
   data = new short[dim * dim];
+  prepared = false;
+}
+
+Filter::~Filter()
+{
+  delete[] data;
 }
 
 short Filter::get(short r, short c)
@@ -16,6 +74,7 @@ short Filter::get(short r, short c)
 void Filter::set(short r, short c, short value)
 {
   data[ r * dim + c ] = value;
+  prepared = false;
 }
 
 short Filter::getDivisor()
@@ -26,6 +85,7 @@ short Filter::getDivisor()
 void Filter::setDivisor(short value)
 {
   divisor = value;
+  prepared = false;
 }
 
 short Filter::getSize()
@@ -43,4 +103,371 @@ void Filter::info()
     }
     cout << endl;
   }
+  if ( type != FILTER_CONVOLVE ) {
+    cout << typeName(type) << endl;
+  }
+  if ( prepared ) {
+    cout << "divisor " << divisor
+	 << " max |sum| " << maxAbsSum
+	 << (separable ? " separable" : "")
+	 << (fitsShortAccumulator() ? " short-accumulator" : " int-accumulator")
+	 << endl;
+  }
+}
+
+FilterType Filter::getType()
+{
+  return type;
+}
+
+void Filter::setType(FilterType value)
+{
+  type = value;
+  prepared = false;
+}
+
+static const char *typeNames[] = { "convolve", "median", "erode", "dilate" };
+
+const char *Filter::typeName(FilterType value)
+{
+  return typeNames[value];
+}
+
+bool Filter::parseType(string name, FilterType *value)
+{
+  for (int t = FILTER_MEDIAN; t <= FILTER_DILATE; t++) {
+    if ( name == typeNames[t] ) {
+      *value = (FilterType) t;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Filter::validate(string &error)
+{
+  if ( dim != FILTER_DIM ) {
+    error = "only 3x3 filters are supported";
+    return false;
+  }
+
+  //
+  // Rank filters: the taps are a 0/1 mask and there is nothing to
+  // divide; prepare() still derives its values from the mask
+  //
+  if ( type != FILTER_CONVOLVE ) {
+    bool any = false;
+    for (short i = 0; i < dim * dim; i++) {
+      if ( data[i] != 0 && data[i] != 1 ) {
+	error = "mask entries must be 0 or 1";
+	return false;
+      }
+      any = any || data[i];
+    }
+    if ( ! any ) {
+      error = "empty mask";
+      return false;
+    }
+    if ( type == FILTER_MEDIAN ) {
+      for (short i = 0; i < dim * dim; i++) {
+	if ( ! data[i] ) {
+	  error = "median uses the full window";
+	  return false;
+	}
+      }
+    }
+    divisor = 1;
+  }
+  if ( divisor == 0 ) {
+    error = "divisor is 0";
+    return false;
+  }
+
+  //
+  // The convolution keeps its taps in chars
+  //
+  for (short i = 0; i < dim * dim; i++) {
+    if ( data[i] < -128 || data[i] > 127 ) {
+      error = "tap out of range [-128, 127]";
+      return false;
+    }
+  }
+  return true;
+}
+
+static int ceilLog2(unsigned int d)
+{
+  int log2d = 0;
+  while ((1u << log2d) < d) {
+    log2d++;
+  }
+  return log2d;
+}
+
+static int absTapSum(short *taps, short n)
+{
+  int sum = 0;
+  for (short i = 0; i < n; i++) {
+    sum += abs(taps[i]);
+  }
+  return sum;
+}
+
+bool Filter::prepare(string &error)
+{
+  if ( ! validate(error) ) {
+    return false;
+  }
+
+  maxAbsSum = 255 * absTapSum(data, dim * dim);
+
+  //
+  // Separable iff every 2x2 minor vanishes (rank 1). Take the first
+  // non-zero row, reduced by its gcd, as the row vector; the column
+  // vector is what each row is a multiple of.
+  //
+  separable = false;
+  short pivot = -1;
+  for (short r = 0; r < dim && pivot < 0; r++) {
+    for (short c = 0; c < dim; c++) {
+      if ( get(r, c) != 0 ) {
+	pivot = r;
+	break;
+      }
+    }
+  }
+  if ( pivot >= 0 ) {
+    bool rankOne = true;
+    for (short r = 0; r < dim && rankOne; r++) {
+      for (short c = 0; c < dim && rankOne; c++) {
+	for (short r2 = r + 1; r2 < dim && rankOne; r2++) {
+	  for (short c2 = c + 1; c2 < dim; c2++) {
+	    if ( get(r, c) * get(r2, c2) != get(r, c2) * get(r2, c) ) {
+	      rankOne = false;
+	      break;
+	    }
+	  }
+	}
+      }
+    }
+    if ( rankOne ) {
+      int g = 0;
+      short lead = -1;
+      for (short c = 0; c < dim; c++) {
+	g = gcd(g, get(pivot, c));
+	if ( lead < 0 && get(pivot, c) != 0 ) {
+	  lead = c;
+	}
+      }
+      for (short c = 0; c < dim; c++) {
+	rowTaps[c] = get(pivot, c) / g;
+      }
+      separable = true;
+      for (short r = 0; r < dim; r++) {
+	if ( get(r, lead) % rowTaps[lead] != 0 ) {
+	  separable = false;
+	  break;
+	}
+	colTaps[r] = get(r, lead) / rowTaps[lead];
+      }
+    }
+  }
+
+  //
+  // Find a multiply/shift that gives exactly the truncating division
+  // for every |sum| the filter can produce.
+  //
+  unsigned int d = abs(divisor);
+  int log2d = ceilLog2(d);
+  divider.negative = divisor < 0;
+  bool found = false;
+  for (int shift = 32 + log2d; shift <= 48 && !found; shift++) {
+    unsigned long long mul = (1ULL << shift) / d + 1;
+    found = true;
+    for (unsigned long long n = 0; n <= (unsigned long long) maxAbsSum; n++) {
+      if ( ((n * mul) >> shift) != n / d ) {
+	found = false;
+	break;
+      }
+    }
+    if ( found ) {
+      divider.mul = mul;
+      divider.shift = shift;
+    }
+  }
+  if ( ! found ) {
+    error = "no exact reciprocal for divisor";
+    return false;
+  }
+
+  prepared = true;
+  return true;
+}
+
+bool Filter::isSeparable()
+{
+  return separable;
+}
+
+short Filter::getRowTap(short c)
+{
+  return rowTaps[c];
+}
+
+short Filter::getColTap(short r)
+{
+  return colTaps[r];
+}
+
+int Filter::getMaxAbsSum()
+{
+  return maxAbsSum;
+}
+
+bool Filter::fitsShortAccumulator()
+{
+  return maxAbsSum <= 32767;
+}
+
+FilterDivider Filter::getDivider()
+{
+  return divider;
+}
+
+bool Filter::isCompiled(string filename)
+{
+  char magic[4];
+  FILE *in = fopen(filename.c_str(), "rb");
+  if ( in == NULL ) {
+    return false;
+  }
+  bool ok = fread(magic, 1, sizeof(magic), in) == sizeof(magic)
+    && memcmp(magic, CFILTER_MAGIC, sizeof(magic)) == 0;
+  fclose(in);
+  return ok;
+}
+
+bool Filter::writeCompiled(string filename, string &error)
+{
+  if ( ! prepared && ! prepare(error) ) {
+    return false;
+  }
+
+  CompiledFilterHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CFILTER_MAGIC, sizeof(hdr.magic));
+  hdr.version = CFILTER_VERSION;
+  hdr.dim = dim;
+  hdr.divisor = divisor;
+  hdr.separable = separable;
+  hdr.type = type;
+  memcpy(hdr.rowTaps, rowTaps, sizeof(hdr.rowTaps));
+  memcpy(hdr.colTaps, colTaps, sizeof(hdr.colTaps));
+  hdr.maxAbsSum = maxAbsSum;
+  hdr.shift = divider.shift;
+  hdr.mul = divider.mul;
+  hdr.checksum = checksum(data, dim * dim * sizeof(short),
+			  checksum(&hdr, sizeof(hdr), 2166136261u));
+
+  FILE *out = fopen(filename.c_str(), "wb");
+  if ( out == NULL ) {
+    error = "can't open " + filename;
+    return false;
+  }
+  bool ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1
+    && fwrite(data, sizeof(short), dim * dim, out) == (size_t) (dim * dim);
+  if ( fclose(out) != 0 || ! ok ) {
+    error = "short write to " + filename;
+    return false;
+  }
+  return true;
+}
+
+//
+// Loads a .cfilter without searching for the divider again. The taps,
+// type and divisor get the same checks as a text filter, and the
+// derived fields the kernels depend on have to agree with them. The
+// divider needs no search to check: with prepare()'s multiplier, any
+// shift of at least 32 + log2(divisor) is exact for every 8 bit sum.
+//
+Filter *Filter::readCompiled(string filename, string &error)
+{
+  CompiledFilterHeader hdr;
+  short taps[FILTER_DIM * FILTER_DIM];
+
+  FILE *in = fopen(filename.c_str(), "rb");
+  if ( in == NULL ) {
+    error = "can't open " + filename;
+    return NULL;
+  }
+  bool ok = fread(&hdr, sizeof(hdr), 1, in) == 1;
+  if ( ok && (memcmp(hdr.magic, CFILTER_MAGIC, sizeof(hdr.magic)) != 0
+	      || hdr.version != CFILTER_VERSION || hdr.dim != FILTER_DIM) ) {
+    fclose(in);
+    error = "not a version 2 3x3 compiled filter";
+    return NULL;
+  }
+  ok = ok && fread(taps, sizeof(short), FILTER_DIM * FILTER_DIM, in) == FILTER_DIM * FILTER_DIM;
+  fclose(in);
+  if ( ! ok ) {
+    error = "truncated compiled filter";
+    return NULL;
+  }
+
+  unsigned int sum = hdr.checksum;
+  hdr.checksum = 0;
+  if ( checksum(taps, sizeof(taps), checksum(&hdr, sizeof(hdr), 2166136261u)) != sum ) {
+    error = "checksum mismatch";
+    return NULL;
+  }
+  if ( hdr.type > FILTER_DILATE ) {
+    error = "unknown filter type";
+    return NULL;
+  }
+
+  Filter *filter = new Filter(hdr.dim);
+  memcpy(filter -> data, taps, sizeof(taps));
+  filter -> type = (FilterType) hdr.type;
+  filter -> divisor = hdr.divisor;
+  if ( ! filter -> validate(error) ) {
+    delete filter;
+    return NULL;
+  }
+  if ( filter -> divisor != hdr.divisor ) {
+    delete filter;
+    error = "bad divisor";
+    return NULL;
+  }
+
+  unsigned int d = abs(hdr.divisor);
+  if ( hdr.shift < 32 + ceilLog2(d) || hdr.shift > 48
+       || hdr.mul != (1ULL << hdr.shift) / d + 1 ) {
+    delete filter;
+    error = "bad divider for the divisor";
+    return NULL;
+  }
+  if ( hdr.maxAbsSum != 255 * absTapSum(taps, FILTER_DIM * FILTER_DIM) ) {
+    delete filter;
+    error = "max |sum| doesn't match the taps";
+    return NULL;
+  }
+  for (short r = 0; hdr.separable && r < FILTER_DIM; r++) {
+    for (short c = 0; c < FILTER_DIM; c++) {
+      if ( hdr.colTaps[r] * hdr.rowTaps[c] != taps[r * FILTER_DIM + c] ) {
+	delete filter;
+	error = "separable taps don't match the filter";
+	return NULL;
+      }
+    }
+  }
+
+  filter -> separable = hdr.separable;
+  memcpy(filter -> rowTaps, hdr.rowTaps, sizeof(hdr.rowTaps));
+  memcpy(filter -> colTaps, hdr.colTaps, sizeof(hdr.colTaps));
+  filter -> maxAbsSum = hdr.maxAbsSum;
+  filter -> divider.mul = hdr.mul;
+  filter -> divider.shift = hdr.shift;
+  filter -> divider.negative = hdr.divisor < 0;
+  filter -> prepared = true;
+  return filter;
 }
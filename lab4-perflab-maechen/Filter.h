@@ -2,15 +2,71 @@
 #ifndef _Filter_h_
 #define _Filter_h_
 
+#include <string>
+
 using namespace std;
 
+//
+// The kernels are all written for 3x3 filters
+//
+#define FILTER_DIM 3
+
+//
+// What the filter computes over each 3x3 window. For the rank filters
+// the taps are a 0/1 mask of the pixels taking part (median always
+// uses the full window).
+//
+enum FilterType {
+  FILTER_CONVOLVE,  // weighted sum / divisor
+  FILTER_MEDIAN,    // median of the window
+  FILTER_ERODE,     // minimum over the mask
+  FILTER_DILATE     // maximum over the mask
+};
+
+//
+// Truncating division by the filter divisor done as a multiply and a
+// shift. prepare() only hands one out after checking it against every
+// accumulator value the filter can produce.
+//
+struct FilterDivider {
+  unsigned long long mul;
+  int shift;
+  bool negative;  // divisor < 0
+
+  inline int divide(int sum) const {
+    unsigned long long mag = sum < 0 ? -(long long) sum : sum;
+    int q = (int) ((mag * mul) >> shift);
+    return ((sum < 0) != negative) ? -q : q;
+  }
+};
+
 class Filter {
+  FilterType type;
   short divisor;
   short dim;
   short *data;
 
+  //
+  // Everything below is derived from the taps by prepare()
+  //
+  bool prepared;
+  bool separable;           // taps == colTaps x rowTaps
+  short rowTaps[FILTER_DIM];
+  short colTaps[FILTER_DIM];
+  int maxAbsSum;            // largest |sum of taps * pixel| for 8 bit pixels
+  FilterDivider divider;
+
+  //
+  // The checks prepare() makes on the size, type, divisor and taps;
+  // readCompiled() makes them too
+  //
+  bool validate(string &error);
+
 public:
   Filter(short _dim);
+  ~Filter();
+  Filter(const Filter &) = delete;
+  Filter &operator=(const Filter &) = delete;
   short get(short r, short c);
   void set(short r, short c, short value);
 
@@ -19,6 +75,36 @@ public:
 
   short getSize();
   void info();
+
+  FilterType getType();
+  void setType(FilterType value);
+
+  //
+  // The .filter header word for a rank filter type, and back
+  //
+  static const char *typeName(FilterType value);
+  static bool parseType(string name, FilterType *value);
+
+  //
+  // Validate size, divisor and taps and precompute the derived values.
+  // Returns false and sets error if the filter can't be run.
+  //
+  bool prepare(string &error);
+
+  bool isSeparable();
+  short getRowTap(short c);
+  short getColTap(short r);
+  int getMaxAbsSum();
+  bool fitsShortAccumulator();
+  FilterDivider getDivider();
+
+  //
+  // Compiled filters: the prepared filter in a small binary file that
+  // can be loaded without any parsing
+  //
+  static bool isCompiled(string filename);
+  static Filter *readCompiled(string filename, string &error);
+  bool writeCompiled(string filename, string &error);
 };
 
 #endif
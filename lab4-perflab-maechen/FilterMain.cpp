@@ -3,7 +3,14 @@
 #include <iostream>
 #include <fstream>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
 #include "Filter.h"
+#include "Resample.h"
+#include "FilterStats.h"
+#include "RankFilter.h"
+#include "RowBand.h"
 
 using namespace std;
 
@@ -13,27 +20,94 @@ using namespace std;
 // Forward declare the functions
 //
 Filter * readFilter(string filename);
-double applyFilter(Filter *filter, cs1300bmp *input, cs1300bmp *output);
+double applyFilter(Filter *filter, cs1300bmp *input, cs1300bmp *output,
+		   FilterStats *stats);
+double applyPipeline(Filter *filter, Resample *resample,
+		     cs1300bmp *input, cs1300bmp *scratch, cs1300bmp *output,
+		     FilterStats *stats);
+static void convolve(Filter *filter, cs1300bmp *input, cs1300bmp *output,
+		     FilterStats *stats);
+static void runFilter(Filter *filter, cs1300bmp *input, cs1300bmp *output,
+		      FilterStats *stats);
+template <typename Acc, bool withStats>
+static void convolveRows(Filter *filter, char filterValues[3][3],
+			 FilterDivider divider,
+			 cs1300bmp *input, cs1300bmp *output,
+			 short rowStart, short rowEnd, FilterStats *stats);
+template <typename Acc, bool withStats>
+static void convolveBand(char filterValues[3][3], FilterDivider divider,
+			 cs1300bmp *input, cs1300bmp *output,
+			 short rowStart, short rowEnd, FilterStats *stats);
+template <typename Acc, bool withStats>
+static void separableBand(short rowTaps[3], short colTaps[3],
+			  FilterDivider divider,
+			  cs1300bmp *input, cs1300bmp *output,
+			  short rowStart, short rowEnd, FilterStats *stats);
+
+static void
+usage(char *prog)
+{
+  fprintf(stderr,"Usage: %s [-s] [-r stage] filter inputfile1 inputfile2 .... \n", prog);
+  fprintf(stderr,"       %s -c out.cfilter filter\n", prog);
+  fprintf(stderr,"  -c out.cfilter    validate filter and save it in compiled form\n");
+  fprintf(stderr,"  -s                per-channel statistics of the filter output;\n");
+  fprintf(stderr,"                    histograms go to <output>.hist\n");
+  fprintf(stderr,"  -r box2           2x2 box decimation after the filter\n");
+  fprintf(stderr,"  -r bilinear:WxH   bilinear resize to WxH after the filter\n");
+  fprintf(stderr,"  -r lanczos:WxH    Lanczos-3 resize to WxH after the filter\n");
+}
 
 int
 main(int argc, char **argv)
 {
+  Resample resample;
+  bool wantStats = false;
+  string compiledName;
+  int opt;
 
-  if ( argc < 2) {
-    fprintf(stderr,"Usage: %s filter inputfile1 inputfile2 .... \n", argv[0]);
+  //
+  // Options must come before the filter name so that the usual
+  // "filter name image image ..." invocation used by Judge still works
+  //
+  while ((opt = getopt(argc, argv, "+sr:c:")) != -1) {
+    switch (opt) {
+    case 'c':
+      compiledName = optarg;
+      break;
+    case 's':
+      wantStats = true;
+      break;
+    case 'r':
+      if ( ! resample.parse(optarg) ) {
+	fprintf(stderr, "Unknown resize stage: %s\n", optarg);
+	usage(argv[0]);
+	return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
       return 1;
+    }
+  }
+
+  if ( argc - optind < 1) {
+    usage(argv[0]);
+    return 1;
   }
 
   //
   // Convert to C++ strings to simplify manipulation
   //
-  string filtername = argv[1];
+  string filtername = argv[optind];
 
   //
-  // remove any ".filter" in the filtername
+  // remove any ".filter" or ".cfilter" in the filtername
   //
   string filterOutputName = filtername;
   string::size_type loc = filterOutputName.find(".filter");
+  if (loc == string::npos) {
+    loc = filterOutputName.find(".cfilter");
+  }
   if (loc != string::npos) {
     //
     // Remove the ".filter" name, which should occur on all the provided filters
@@ -43,10 +117,24 @@ main(int argc, char **argv)
 
   Filter *filter = readFilter(filtername);
 
+  if ( ! compiledName.empty() ) {
+    string error;
+    bool ok = filter -> writeCompiled(compiledName, error);
+    if ( ! ok ) {
+      cerr << "Unable to write " << compiledName << ": " << error << endl;
+    }
+    delete filter;
+    return ok ? 0 : 1;
+  }
+
   double sum = 0.0;
   short samples = 0;
 
-  for (int inNum = 2; inNum < argc; inNum++) {
+  if ( resample.getKind() != RESAMPLE_NONE ) {
+    filterOutputName = filterOutputName + "-" + resample.getName();
+  }
+
+  for (int inNum = optind + 1; inNum < argc; inNum++) {
     string inputFilename = argv[inNum];
     string outputFilename = "filtered-" + filterOutputName + "-" + inputFilename;
     struct cs1300bmp *input = new struct cs1300bmp;
@@ -54,63 +142,111 @@ main(int argc, char **argv)
     short ok = cs1300bmp_readfile( (char *) inputFilename.c_str(), input);
 
     if ( ok ) {
-      double sample = applyFilter(filter, input, output);
+      FilterStats stats;
+      FilterStats *statsp = wantStats ? &stats : NULL;
+      double sample;
+      if ( resample.getKind() == RESAMPLE_NONE ) {
+	sample = applyFilter(filter, input, output, statsp);
+      } else {
+	struct cs1300bmp *scratch = new struct cs1300bmp;
+	sample = applyPipeline(filter, &resample, input, scratch, output, statsp);
+	delete scratch;
+      }
       sum += sample;
       samples++;
       cs1300bmp_writefile((char *) outputFilename.c_str(), output);
+      if ( wantStats ) {
+	stats.print(stdout, outputFilename);
+	if ( ! stats.writeHistogram(outputFilename + ".hist") ) {
+	  fprintf(stderr, "Unable to write %s.hist\n", outputFilename.c_str());
+	}
+      }
     }
     delete input;
     delete output;
   }
   fprintf(stdout, "Average cycles per sample is %f\n", sum / samples);
+  delete filter;
 
 }
 
+//
+// Load a filter, either a compiled .cfilter (no parsing at all) or the
+// text format: size, divisor, then size * size taps. A leading type
+// word selects a rank filter instead: "median 3", or "erode 3" /
+// "dilate 3" followed by a 0/1 mask of size * size. Anything that is
+// truncated, malformed or can't be run (divisor 0, taps out of range)
+// is rejected here instead of producing garbage or a SIGFPE later.
+//
 class Filter *
 readFilter(string filename)
 {
+  string error;
+
+  if ( Filter::isCompiled(filename) ) {
+    Filter *filter = Filter::readCompiled(filename, error);
+    if ( filter == NULL ) {
+      cerr << "Bad compiled filter " << filename << ": " << error << endl;
+      exit(-1);
+    }
+    return filter;
+  }
+
   ifstream input(filename.c_str());
 
-  if ( ! input.bad() ) {
-    short size = 0;
-    input >> size;
-    Filter *filter = new Filter(size);
-    short div;
-    input >> div;
-    filter -> setDivisor(div);
-
-	short value;
-	input >> value;
-	filter -> set(0,0,value);
-	input >> value;
-	filter -> set(0,1,value);
-          
-	input >> value;
-	filter -> set(0,2,value);
-          
-	input >> value;
-	filter -> set(1,0,value);
-          
-	input >> value;
-	filter -> set(1,1,value);
-          
-	input >> value;
-	filter -> set(1,2,value);
-          
-	input >> value;
-	filter -> set(2,0,value);
-          
-	input >> value;
-	filter -> set(2,1,value);
-          
-	input >> value;
-	filter -> set(2,2,value);
+  if ( ! input.is_open() ) {
+    cerr << "Bad input in readFilter:" << filename << endl;
+    exit(-1);
+  }
 
-    return filter;
+  FilterType type = FILTER_CONVOLVE;
+  string word;
+  short size = 0;
+  short div = 1;
+  if ( ! (input >> word) ) {
+    cerr << "Bad filter " << filename << ": empty" << endl;
+    exit(-1);
+  }
+  if ( Filter::parseType(word, &type) ) {
+    if ( ! (input >> size) ) {
+      cerr << "Bad filter " << filename << ": missing size" << endl;
+      exit(-1);
+    }
   } else {
-    cerr << "Bad input in readFilter:" << filename << endl;
+    char *end;
+    size = strtol(word.c_str(), &end, 10);
+    if ( *end != '\0' || ! (input >> div) ) {
+      cerr << "Bad filter " << filename << ": missing size or divisor" << endl;
+      exit(-1);
+    }
+  }
+  if ( size != FILTER_DIM ) {
+    cerr << "Bad filter " << filename << ": size " << size
+	 << ", only " << FILTER_DIM << "x" << FILTER_DIM << " is supported" << endl;
+    exit(-1);
+  }
+
+  Filter *filter = new Filter(size);
+  filter -> setType(type);
+  filter -> setDivisor(div);
+
+  for (short i = 0; i < size; i++) {
+    for (short j = 0; j < size; j++) {
+      short value = 1;
+      if ( type != FILTER_MEDIAN && ! (input >> value) ) {
+	cerr << "Bad filter " << filename << ": truncated at tap ("
+	     << i << "," << j << ")" << endl;
+	exit(-1);
+      }
+      filter -> set(i, j, value);
+    }
+  }
+
+  if ( ! filter -> prepare(error) ) {
+    cerr << "Bad filter " << filename << ": " << error << endl;
     exit(-1);
   }
+  return filter;
 }
 
 
@@ -167,17 +303,90 @@ double
 //   return diffPerPixel;
 // }
 
-applyFilter(class Filter *filter, cs1300bmp *input, cs1300bmp *output) {
+applyFilter(class Filter *filter, cs1300bmp *input, cs1300bmp *output,
+	    FilterStats *stats) {
+    long long cycStart, cycStop;
+    cycStart = rdtscll();
+
+    runFilter(filter, input, output, stats);
+
+    cycStop = rdtscll();
+    double diff = cycStop - cycStart;
+    double diffPerPixel = diff / (input->width * input->height);
+
+    fprintf(stderr, "Took %f cycles to process, or %f cycles per pixel\n", diff, diffPerPixel);
+    return diffPerPixel;
+}
+
+//
+// Convolution followed by a resize stage. Cycles are reported per
+// *input* pixel so the numbers compare directly with applyFilter.
+// A blur followed by box2 is fused and never materializes the full
+// size intermediate; everything else goes through scratch. Statistics
+// always describe the convolution output, so asking for them turns
+// fusion off.
+//
+double
+applyPipeline(Filter *filter, Resample *resample,
+	      cs1300bmp *input, cs1300bmp *scratch, cs1300bmp *output,
+	      FilterStats *stats) {
     long long cycStart, cycStop;
     cycStart = rdtscll();
 
+    if ( stats == NULL && resample->canFuse(filter) ) {
+        resample->applyFused(filter, input, output);
+    } else {
+        short h = input->height;
+        short w = input->width;
+
+        //
+        // The filters leave the border alone; make it black like the
+        // freshly allocated output applyFilter writes into
+        //
+        for (int plane = 0; plane < 3; plane++) {
+            memset(scratch->color[plane][0], 0, w);
+            memset(scratch->color[plane][h - 1], 0, w);
+            for (short row = 1; row < h - 1; row++) {
+                scratch->color[plane][row][0] = 0;
+                scratch->color[plane][row][w - 1] = 0;
+            }
+        }
+        runFilter(filter, input, scratch, stats);
+        resample->apply(scratch, output);
+    }
+
+    cycStop = rdtscll();
+    double diff = cycStop - cycStart;
+    double diffPerPixel = diff / (input->width * input->height);
+
+    fprintf(stderr, "Took %f cycles to process, or %f cycles per pixel\n", diff, diffPerPixel);
+    return diffPerPixel;
+}
+
+//
+// The rank filters (median, erode, dilate) have their own engine;
+// everything else is a weighted sum.
+//
+static void
+runFilter(class Filter *filter, cs1300bmp *input, cs1300bmp *output,
+          FilterStats *stats) {
+    if ( filter->getType() == FILTER_CONVOLVE ) {
+        convolve(filter, input, output, stats);
+    } else {
+        rankFilter(filter, input, output, stats);
+    }
+}
+
+static void
+convolve(class Filter *filter, cs1300bmp *input, cs1300bmp *output,
+         FilterStats *stats) {
     short h = input->height;
     short w = input->width;
     
     output->width = w;
     output->height = h;
 
-    short fDivisor = filter->getDivisor(); // Precompute divisor
+    FilterDivider divider = filter->getDivider(); // Precomputed by prepare()
 
     // Precompute filter values and store them in a temporary array
     char filterValues[3][3];
@@ -193,11 +402,72 @@ applyFilter(class Filter *filter, cs1300bmp *input, cs1300bmp *output) {
     filterValues[2][1] = filter->get(2, 1);
     filterValues[2][2] = filter->get(2, 2);
 
-    for (short row = 1; row < h - 1; row++) {
+    //
+    // Interior rows are split into one band per thread. With statistics
+    // on, each thread fills its own partial and merges it once at the
+    // end, so the histograms are never shared between threads.
+    // Filters whose worst case sum fits use short accumulators.
+    //
+    bool narrow = filter->fitsShortAccumulator();
+#pragma omp parallel
+    {
+        short rowStart, rowEnd;
+        rowBand(1, h - 1, &rowStart, &rowEnd);
+        if ( stats ) {
+            FilterStats partial;
+            if ( narrow ) {
+                convolveRows<short, true>(filter, filterValues, divider, input, output,
+                                          rowStart, rowEnd, &partial);
+            } else {
+                convolveRows<int, true>(filter, filterValues, divider, input, output,
+                                        rowStart, rowEnd, &partial);
+            }
+#pragma omp critical
+            stats->merge(partial);
+        } else if ( narrow ) {
+            convolveRows<short, false>(filter, filterValues, divider, input, output,
+                                       rowStart, rowEnd, NULL);
+        } else {
+            convolveRows<int, false>(filter, filterValues, divider, input, output,
+                                     rowStart, rowEnd, NULL);
+        }
+    }
+}
+
+//
+// One band of rows through the separable or the general kernel
+//
+template <typename Acc, bool withStats>
+static void
+convolveRows(Filter *filter, char filterValues[3][3], FilterDivider divider,
+             cs1300bmp *input, cs1300bmp *output,
+             short rowStart, short rowEnd, FilterStats *stats) {
+    if ( filter->isSeparable() ) {
+        short rowTaps[3], colTaps[3];
+        for (short i = 0; i < 3; i++) {
+            rowTaps[i] = filter->getRowTap(i);
+            colTaps[i] = filter->getColTap(i);
+        }
+        separableBand<Acc, withStats>(rowTaps, colTaps, divider, input, output,
+                                      rowStart, rowEnd, stats);
+    } else {
+        convolveBand<Acc, withStats>(filterValues, divider, input, output,
+                                     rowStart, rowEnd, stats);
+    }
+}
+
+template <typename Acc, bool withStats>
+static void
+convolveBand(char filterValues[3][3], FilterDivider divider,
+             cs1300bmp *input, cs1300bmp *output,
+             short rowStart, short rowEnd, FilterStats *stats) {
+    short w = input->width;
+
+    for (short row = rowStart; row < rowEnd; row++) {
         for (short col = 1; col < w - 1; col++) {
-            short result0 = 0;
-            short result1 = 0;
-            short result2 = 0;
+            Acc result0 = 0;
+            Acc result1 = 0;
+            Acc result2 = 0;
             
             result0 += input->color[0][row - 1][col - 1] * filterValues[0][0];
             result0 += input->color[0][row - 1][col] * filterValues[0][1];
@@ -229,10 +499,15 @@ applyFilter(class Filter *filter, cs1300bmp *input, cs1300bmp *output) {
             result2 += input->color[2][row + 1][col] * filterValues[2][1];
             result2 += input->color[2][row + 1][col + 1] * filterValues[2][2];
 
-            result0 /= fDivisor;
-            result1 /= fDivisor;
-            result2 /= fDivisor;
+            result0 = divider.divide(result0);
+            result1 = divider.divide(result1);
+            result2 = divider.divide(result2);
 
+            if (withStats) {
+                stats->add(0, result0);
+                stats->add(1, result1);
+                stats->add(2, result2);
+            }
 
             if ( result0  < 0 ) {
               result0 = 0;
@@ -257,13 +532,67 @@ applyFilter(class Filter *filter, cs1300bmp *input, cs1300bmp *output) {
             output->color[2][row][col] = result2;
         }
     }
-
-    cycStop = rdtscll();
-    double diff = cycStop - cycStart;
-    double diffPerPixel = diff / (w * h);
-
-    fprintf(stderr, "Took %f cycles to process, or %f cycles per pixel\n", diff, diffPerPixel);
-    return diffPerPixel;
 }
 
+//
+// Filters that prepare() found to be colTaps x rowTaps (avg, hline,
+// vline) in two passes: every input row is filtered horizontally once
+// into a ring of three rows, and each output row is the column taps
+// over the ring. That is 6 multiplies per pixel instead of 9, and
+// fewer still since zero taps are skipped. The sums are the same
+// integers convolveBand computes, so the output is identical.
+//
+template <typename Acc, bool withStats>
+static void
+separableBand(short rowTaps[3], short colTaps[3], FilterDivider divider,
+              cs1300bmp *input, cs1300bmp *output,
+              short rowStart, short rowEnd, FilterStats *stats) {
+    short w = input->width;
+    std::vector<Acc> ring(3 * w);
+    std::vector<Acc> sum(w);
+
+    for (int plane = 0; plane < 3; plane++) {
+        for (short row = rowStart - 1; row <= rowEnd; row++) {
+            unsigned char *in = input->color[plane][row];
+            Acc *h = &ring[(row % 3) * w];
+            memset(h, 0, w * sizeof(Acc));
+            for (short t = 0; t < 3; t++) {
+                if ( rowTaps[t] == 0 ) {
+                    continue;
+                }
+                for (short col = 1; col < w - 1; col++) {
+                    h[col] += in[col + t - 1] * rowTaps[t];
+                }
+            }
 
+            short out = row - 1;
+            if ( out < rowStart ) {
+                continue;
+            }
+            memset(&sum[0], 0, w * sizeof(Acc));
+            for (short t = 0; t < 3; t++) {
+                if ( colTaps[t] == 0 ) {
+                    continue;
+                }
+                const Acc *src = &ring[((out + t - 1) % 3) * w];
+                for (short col = 1; col < w - 1; col++) {
+                    sum[col] += src[col] * colTaps[t];
+                }
+            }
+            unsigned char *dst = output->color[plane][out];
+            for (short col = 1; col < w - 1; col++) {
+                Acc result = divider.divide(sum[col]);
+                if (withStats) {
+                    stats->add(plane, result);
+                }
+                if ( result < 0 ) {
+                    result = 0;
+                }
+                else if ( result > 255 ) {
+                    result = 255;
+                }
+                dst[col] = result;
+            }
+        }
+    }
+}
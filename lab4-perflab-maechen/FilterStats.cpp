@@ -0,0 +1,110 @@
+#include "FilterStats.h"
+#include <string.h>
+
+static const char *planeNames[MAX_COLORS] = { "red", "green", "blue" };
+
+FilterStats::FilterStats()
+{
+  clear();
+}
+
+void FilterStats::clear()
+{
+  memset(hist, 0, sizeof(hist));
+  memset(clampedLow, 0, sizeof(clampedLow));
+  memset(clampedHigh, 0, sizeof(clampedHigh));
+}
+
+void FilterStats::merge(FilterStats &other)
+{
+  for (int plane = 0; plane < MAX_COLORS; plane++) {
+    for (int v = 0; v < 256; v++) {
+      hist[plane][v] += other.hist[plane][v];
+    }
+    clampedLow[plane] += other.clampedLow[plane];
+    clampedHigh[plane] += other.clampedHigh[plane];
+  }
+}
+
+unsigned int FilterStats::pixels(int plane)
+{
+  unsigned int total = 0;
+  for (int v = 0; v < 256; v++) {
+    total += hist[plane][v];
+  }
+  return total;
+}
+
+int FilterStats::minimum(int plane)
+{
+  for (int v = 0; v < 256; v++) {
+    if ( hist[plane][v] ) {
+      return v;
+    }
+  }
+  return -1;
+}
+
+int FilterStats::maximum(int plane)
+{
+  for (int v = 255; v >= 0; v--) {
+    if ( hist[plane][v] ) {
+      return v;
+    }
+  }
+  return -1;
+}
+
+double FilterStats::mean(int plane)
+{
+  unsigned int n = pixels(plane);
+  if ( n == 0 ) {
+    return 0.0;
+  }
+  double sum = 0.0;
+  for (int v = 0; v < 256; v++) {
+    sum += (double) v * hist[plane][v];
+  }
+  return sum / n;
+}
+
+double FilterStats::variance(int plane)
+{
+  unsigned int n = pixels(plane);
+  if ( n == 0 ) {
+    return 0.0;
+  }
+  double mu = mean(plane);
+  double sum = 0.0;
+  for (int v = 0; v < 256; v++) {
+    sum += (v - mu) * (v - mu) * hist[plane][v];
+  }
+  return sum / n;
+}
+
+void FilterStats::print(FILE *out, string name)
+{
+  fprintf(out, "Stats for %s\n", name.c_str());
+  for (int plane = 0; plane < MAX_COLORS; plane++) {
+    fprintf(out, "  %-5s pixels %u min %d max %d mean %.3f var %.3f clamped-low %u clamped-high %u\n",
+	    planeNames[plane], pixels(plane), minimum(plane), maximum(plane),
+	    mean(plane), variance(plane), clampedLow[plane], clampedHigh[plane]);
+  }
+}
+
+//
+// One line per value: value,red,green,blue
+//
+bool FilterStats::writeHistogram(string filename)
+{
+  FILE *out = fopen(filename.c_str(), "w");
+  if ( out == NULL ) {
+    return false;
+  }
+  fprintf(out, "value,%s,%s,%s\n", planeNames[0], planeNames[1], planeNames[2]);
+  for (int v = 0; v < 256; v++) {
+    fprintf(out, "%d,%u,%u,%u\n", v, hist[0][v], hist[1][v], hist[2][v]);
+  }
+  fclose(out);
+  return true;
+}
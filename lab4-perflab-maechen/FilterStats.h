@@ -0,0 +1,53 @@
+//-*-c++-*-
+#ifndef _FilterStats_h_
+#define _FilterStats_h_
+
+#include <stdio.h>
+#include <string>
+#include "cs1300bmp.h"
+
+using namespace std;
+
+//
+// Per-channel statistics of the filter output, accumulated in the
+// output loop itself. Only the histogram and the clamp counters are
+// touched per pixel; min, max, mean and variance all fall out of the
+// histogram at the end.
+//
+class FilterStats {
+  unsigned int hist[MAX_COLORS][256];
+  unsigned int clampedLow[MAX_COLORS];   // results below 0, stored as 0
+  unsigned int clampedHigh[MAX_COLORS];  // results above 255, stored as 255
+
+public:
+  FilterStats();
+  void clear();
+
+  //
+  // Record one unclamped result for the given plane
+  //
+  inline void add(int plane, int value) {
+    if ( value < 0 ) {
+      clampedLow[plane]++;
+      value = 0;
+    }
+    else if ( value > 255 ) {
+      clampedHigh[plane]++;
+      value = 255;
+    }
+    hist[plane][value]++;
+  }
+
+  void merge(FilterStats &other);
+
+  unsigned int pixels(int plane);
+  int minimum(int plane);
+  int maximum(int plane);
+  double mean(int plane);
+  double variance(int plane);
+
+  void print(FILE *out, string name);
+  bool writeHistogram(string filename);
+};
+
+#endif
@@ -0,0 +1,184 @@
+#include "RankFilter.h"
+#include "RowBand.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//
+// The window operations are written once against a "lane" that is
+// either a single pixel or, with SSE2, 16 neighbouring pixels of a
+// row. All they need is load/store and unsigned min/max, which is
+// exactly what pminub/pmaxub give us.
+//
+struct ScalarLane {
+  typedef unsigned char V;
+  enum { width = 1 };
+  static inline V load(const unsigned char *p) { return *p; }
+  static inline void store(unsigned char *p, V v) { *p = v; }
+  static inline V splat(unsigned char v) { return v; }
+  static inline V min(V a, V b) { return a < b ? a : b; }
+  static inline V max(V a, V b) { return a > b ? a : b; }
+};
+
+#ifdef __SSE2__
+struct SSELane {
+  typedef __m128i V;
+  enum { width = 16 };
+  static inline V load(const unsigned char *p) { return _mm_loadu_si128((const __m128i *) p); }
+  static inline void store(unsigned char *p, V v) { _mm_storeu_si128((__m128i *) p, v); }
+  static inline V splat(unsigned char v) { return _mm_set1_epi8((char) v); }
+  static inline V min(V a, V b) { return _mm_min_epu8(a, b); }
+  static inline V max(V a, V b) { return _mm_max_epu8(a, b); }
+};
+#endif
+
+template <typename Lane>
+static inline void sort2(typename Lane::V &a, typename Lane::V &b)
+{
+  typename Lane::V lo = Lane::min(a, b);
+  b = Lane::max(a, b);
+  a = lo;
+}
+
+//
+// Median of 9 with the 19 compare-exchange network from Paeth
+// (Graphics Gems); branch free, so it vectorizes as is.
+//
+template <typename Lane>
+static inline typename Lane::V median9(typename Lane::V p[9])
+{
+  sort2<Lane>(p[1], p[2]); sort2<Lane>(p[4], p[5]); sort2<Lane>(p[7], p[8]);
+  sort2<Lane>(p[0], p[1]); sort2<Lane>(p[3], p[4]); sort2<Lane>(p[6], p[7]);
+  sort2<Lane>(p[1], p[2]); sort2<Lane>(p[4], p[5]); sort2<Lane>(p[7], p[8]);
+  sort2<Lane>(p[0], p[3]); sort2<Lane>(p[5], p[8]); sort2<Lane>(p[4], p[7]);
+  sort2<Lane>(p[3], p[6]); sort2<Lane>(p[1], p[4]); sort2<Lane>(p[2], p[5]);
+  sort2<Lane>(p[4], p[7]); sort2<Lane>(p[4], p[2]); sort2<Lane>(p[6], p[4]);
+  sort2<Lane>(p[4], p[2]);
+  return p[4];
+}
+
+//
+// Result for the window(s) centred on up/mid/down[0]
+//
+template <typename Lane, FilterType type>
+static inline typename Lane::V windowAt(const unsigned char *up, const unsigned char *mid,
+					const unsigned char *down, const bool mask[9])
+{
+  typename Lane::V p[9] = {
+    Lane::load(up - 1), Lane::load(up), Lane::load(up + 1),
+    Lane::load(mid - 1), Lane::load(mid), Lane::load(mid + 1),
+    Lane::load(down - 1), Lane::load(down), Lane::load(down + 1)
+  };
+
+  if ( type == FILTER_MEDIAN ) {
+    return median9<Lane>(p);
+  }
+
+  typename Lane::V acc = Lane::splat(type == FILTER_ERODE ? 255 : 0);
+  for (int t = 0; t < 9; t++) {
+    if ( mask[t] ) {
+      acc = (type == FILTER_ERODE) ? Lane::min(acc, p[t]) : Lane::max(acc, p[t]);
+    }
+  }
+  return acc;
+}
+
+template <FilterType type, bool withStats>
+static void rankBand(const bool mask[9], cs1300bmp *input, cs1300bmp *output,
+		     short rowStart, short rowEnd, FilterStats *stats)
+{
+  short w = input -> width;
+
+  for (int plane = 0; plane < 3; plane++) {
+    for (short row = rowStart; row < rowEnd; row++) {
+      const unsigned char *up = input -> color[plane][row - 1];
+      const unsigned char *mid = input -> color[plane][row];
+      const unsigned char *down = input -> color[plane][row + 1];
+      unsigned char *out = output -> color[plane][row];
+
+      short col = 1;
+#ifdef __SSE2__
+      //
+      // Whole vectors while the rightmost load (col + 16) is still
+      // inside the row, then finish pixel by pixel
+      //
+      for (; col + SSELane::width <= w - 1; col += SSELane::width) {
+	SSELane::store(out + col,
+		       windowAt<SSELane, type>(up + col, mid + col, down + col, mask));
+      }
+#endif
+      for (; col < w - 1; col++) {
+	out[col] = windowAt<ScalarLane, type>(up + col, mid + col, down + col, mask);
+      }
+
+      //
+      // The row we just wrote is still in L1
+      //
+      if ( withStats ) {
+	for (col = 1; col < w - 1; col++) {
+	  stats -> add(plane, out[col]);
+	}
+      }
+    }
+  }
+}
+
+template <FilterType type>
+static void rankBandStats(const bool mask[9], cs1300bmp *input, cs1300bmp *output,
+			  short rowStart, short rowEnd, FilterStats *stats)
+{
+  if ( stats ) {
+    rankBand<type, true>(mask, input, output, rowStart, rowEnd, stats);
+  } else {
+    rankBand<type, false>(mask, input, output, rowStart, rowEnd, NULL);
+  }
+}
+
+void rankFilter(Filter *filter, cs1300bmp *input, cs1300bmp *output,
+		FilterStats *stats)
+{
+  short h = input -> height;
+  short w = input -> width;
+  output -> width = w;
+  output -> height = h;
+
+  bool mask[9];
+  for (short r = 0; r < 3; r++) {
+    for (short c = 0; c < 3; c++) {
+      mask[r * 3 + c] = filter -> get(r, c) != 0;
+    }
+  }
+  FilterType type = filter -> getType();
+
+  //
+  // One band of rows per thread, per-thread partial statistics merged
+  // at the end just like the convolution
+  //
+#pragma omp parallel
+  {
+    short rowStart, rowEnd;
+    rowBand(1, h - 1, &rowStart, &rowEnd);
+    FilterStats partial;
+    FilterStats *mine = stats ? &partial : NULL;
+
+    switch (type) {
+    case FILTER_MEDIAN:
+      rankBandStats<FILTER_MEDIAN>(mask, input, output, rowStart, rowEnd, mine);
+      break;
+    case FILTER_ERODE:
+      rankBandStats<FILTER_ERODE>(mask, input, output, rowStart, rowEnd, mine);
+      break;
+    case FILTER_DILATE:
+      rankBandStats<FILTER_DILATE>(mask, input, output, rowStart, rowEnd, mine);
+      break;
+    default:
+      break;
+    }
+
+    if ( stats ) {
+#pragma omp critical
+      stats -> merge(partial);
+    }
+  }
+}
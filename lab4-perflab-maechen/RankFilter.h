@@ -0,0 +1,17 @@
+//-*-c++-*-
+#ifndef _RankFilter_h_
+#define _RankFilter_h_
+
+#include "cs1300bmp.h"
+#include "Filter.h"
+#include "FilterStats.h"
+
+//
+// Median, erode and dilate over 3x3 windows. Same contract as the
+// convolution: the interior is written, the one pixel border is not,
+// and stats (if not NULL) receives every written pixel.
+//
+void rankFilter(Filter *filter, cs1300bmp *input, cs1300bmp *output,
+		FilterStats *stats);
+
+#endif
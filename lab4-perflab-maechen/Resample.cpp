@@ -0,0 +1,421 @@
+#include "Resample.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+//
+// Lanczos lobes and the fixed point precision of the resampling weights.
+// Horizontal results keep 8 fractional bits so the vertical pass still
+// fits in an int accumulator.
+//
+#define LANCZOS_A 3
+#define WEIGHT_BITS 12
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+#define INTER_BITS 8
+
+//
+// Per output coordinate taps: source index (already clamped to the
+// image) and fixed point weight. Every output uses "stride" slots,
+// unused slots have weight 0.
+//
+struct Contribs {
+  int stride;
+  vector<int> index;
+  vector<int> weight;
+};
+
+static inline unsigned char clampPixel(int value)
+{
+  if ( value < 0 ) {
+    return 0;
+  }
+  else if ( value > 255 ) {
+    return 255;
+  }
+  return value;
+}
+
+static double lanczos(double x)
+{
+  if ( x == 0.0 ) {
+    return 1.0;
+  }
+  if ( x <= -LANCZOS_A || x >= LANCZOS_A ) {
+    return 0.0;
+  }
+  double px = M_PI * x;
+  return LANCZOS_A * sin(px) * sin(px / LANCZOS_A) / (px * px);
+}
+
+//
+// Build the Lanczos taps for one axis. When shrinking, the kernel is
+// stretched by the scale factor so that it also acts as the low-pass
+// filter and we don't alias.
+//
+static void lanczosContribs(short inSize, short outSize, Contribs &c)
+{
+  double scale = (double) inSize / outSize;
+  double stretch = scale > 1.0 ? scale : 1.0;
+  double support = LANCZOS_A * stretch;
+
+  c.stride = 2 * (int) ceil(support) + 1;
+  c.index.assign(outSize * c.stride, 0);
+  c.weight.assign(outSize * c.stride, 0);
+
+  vector<double> w(c.stride);
+  for (int o = 0; o < outSize; o++) {
+    double center = (o + 0.5) * scale - 0.5;
+    int first = (int) floor(center - support) + 1;
+    int count = (int) floor(center + support) - first + 1;
+    if ( count > c.stride ) {
+      count = c.stride;
+    }
+
+    double total = 0.0;
+    for (int t = 0; t < count; t++) {
+      w[t] = lanczos((first + t - center) / stretch);
+      total += w[t];
+    }
+
+    //
+    // Normalize and convert to fixed point; any rounding error goes
+    // to the biggest tap so that flat areas stay exactly flat.
+    //
+    int *index = &c.index[o * c.stride];
+    int *weight = &c.weight[o * c.stride];
+    int sum = 0;
+    int biggest = 0;
+    for (int t = 0; t < count; t++) {
+      int src = first + t;
+      if ( src < 0 ) {
+	src = 0;
+      }
+      else if ( src >= inSize ) {
+	src = inSize - 1;
+      }
+      index[t] = src;
+      weight[t] = (int) lround(w[t] / total * WEIGHT_ONE);
+      sum += weight[t];
+      if ( weight[t] > weight[biggest] ) {
+	biggest = t;
+      }
+    }
+    weight[biggest] += WEIGHT_ONE - sum;
+  }
+}
+
+//
+// Bilinear source coordinate for one axis: the two neighbours and the
+// 8 bit weight of the second one.
+//
+static void bilinearCoords(short inSize, short outSize,
+			   vector<int> &lo, vector<int> &hi, vector<int> &frac)
+{
+  double scale = (double) inSize / outSize;
+  lo.resize(outSize);
+  hi.resize(outSize);
+  frac.resize(outSize);
+
+  for (int o = 0; o < outSize; o++) {
+    double src = (o + 0.5) * scale - 0.5;
+    if ( src < 0.0 ) {
+      src = 0.0;
+    }
+    int base = (int) src;
+    if ( base >= inSize - 1 ) {
+      lo[o] = hi[o] = inSize - 1;
+      frac[o] = 0;
+    } else {
+      lo[o] = base;
+      hi[o] = base + 1;
+      frac[o] = (int) lround((src - base) * 256);
+    }
+  }
+}
+
+Resample::Resample()
+{
+  kind = RESAMPLE_NONE;
+  outWidth = 0;
+  outHeight = 0;
+}
+
+bool Resample::parse(string spec)
+{
+  short w, h;
+  char trailing;
+
+  if ( spec == "box2" ) {
+    kind = RESAMPLE_BOX2;
+    return true;
+  }
+
+  ResampleKind k;
+  string::size_type colon = spec.find(':');
+  if ( colon == string::npos ) {
+    return false;
+  }
+  string name = spec.substr(0, colon);
+  if ( name == "bilinear" ) {
+    k = RESAMPLE_BILINEAR;
+  }
+  else if ( name == "lanczos" ) {
+    k = RESAMPLE_LANCZOS;
+  }
+  else {
+    return false;
+  }
+
+  if ( sscanf(spec.c_str() + colon + 1, "%hdx%hd%c", &w, &h, &trailing) != 2 ) {
+    return false;
+  }
+  if ( w < 1 || h < 1 || w > MAX_DIM || h > MAX_DIM ) {
+    return false;
+  }
+
+  kind = k;
+  outWidth = w;
+  outHeight = h;
+  return true;
+}
+
+ResampleKind Resample::getKind()
+{
+  return kind;
+}
+
+string Resample::getName()
+{
+  char buf[64];
+
+  switch (kind) {
+  case RESAMPLE_BOX2:
+    return "box2";
+  case RESAMPLE_BILINEAR:
+    snprintf(buf, sizeof(buf), "bilinear%dx%d", outWidth, outHeight);
+    return buf;
+  case RESAMPLE_LANCZOS:
+    snprintf(buf, sizeof(buf), "lanczos%dx%d", outWidth, outHeight);
+    return buf;
+  default:
+    return "";
+  }
+}
+
+void Resample::outputSize(short inW, short inH, short *outW, short *outH)
+{
+  if ( kind == RESAMPLE_BOX2 ) {
+    *outW = inW / 2;
+    *outH = inH / 2;
+  }
+  else if ( kind == RESAMPLE_NONE ) {
+    *outW = inW;
+    *outH = inH;
+  }
+  else {
+    *outW = outWidth;
+    *outH = outHeight;
+  }
+}
+
+//
+// Only a 2x2 box can be folded into the 3x3 kernel, and only when the
+// kernel is a blur that can't brighten: no negative taps and taps that
+// sum to at most the divisor. Then every convolved pixel is already in
+// 0..255, so the fused path never has to clamp the intermediate. A
+// filter like "all ones over 6" does saturate and goes through scratch.
+//
+bool Resample::canFuse(Filter *filter)
+{
+  if ( kind != RESAMPLE_BOX2 || filter -> getType() != FILTER_CONVOLVE
+       || filter -> getSize() != 3 || filter -> getDivisor() <= 0 ) {
+    return false;
+  }
+  int sum = 0;
+  for (short i = 0; i < 3; i++) {
+    for (short j = 0; j < 3; j++) {
+      if ( filter -> get(i, j) < 0 ) {
+	return false;
+      }
+      sum += filter -> get(i, j);
+    }
+  }
+  return sum <= filter -> getDivisor();
+}
+
+void Resample::apply(cs1300bmp *input, cs1300bmp *output)
+{
+  short w = input -> width;
+  short h = input -> height;
+  short ow, oh;
+  outputSize(w, h, &ow, &oh);
+  output -> width = ow;
+  output -> height = oh;
+
+  if ( kind == RESAMPLE_BOX2 ) {
+    for (int plane = 0; plane < 3; plane++) {
+      for (short row = 0; row < oh; row++) {
+	unsigned char *top = input -> color[plane][2 * row];
+	unsigned char *bot = input -> color[plane][2 * row + 1];
+	unsigned char *out = output -> color[plane][row];
+	for (short col = 0; col < ow; col++) {
+	  out[col] = (top[2 * col] + top[2 * col + 1]
+		      + bot[2 * col] + bot[2 * col + 1] + 2) >> 2;
+	}
+      }
+    }
+  }
+  else if ( kind == RESAMPLE_BILINEAR ) {
+    vector<int> x0, x1, fx, y0, y1, fy;
+    bilinearCoords(w, ow, x0, x1, fx);
+    bilinearCoords(h, oh, y0, y1, fy);
+
+    for (int plane = 0; plane < 3; plane++) {
+      for (short row = 0; row < oh; row++) {
+	unsigned char *top = input -> color[plane][y0[row]];
+	unsigned char *bot = input -> color[plane][y1[row]];
+	unsigned char *out = output -> color[plane][row];
+	int wy = fy[row];
+	for (short col = 0; col < ow; col++) {
+	  int wx = fx[col];
+	  int t = top[x0[col]] * (256 - wx) + top[x1[col]] * wx;
+	  int b = bot[x0[col]] * (256 - wx) + bot[x1[col]] * wx;
+	  out[col] = (t * (256 - wy) + b * wy + (1 << 15)) >> 16;
+	}
+      }
+    }
+  }
+  else if ( kind == RESAMPLE_LANCZOS ) {
+    Contribs cx, cy;
+    lanczosContribs(w, ow, cx);
+    lanczosContribs(h, oh, cy);
+
+    //
+    // Horizontal pass into an int buffer of h x ow, then a vertical
+    // pass that walks whole rows of that buffer at a time.
+    //
+    vector<int> tmp(h * ow);
+    vector<int> acc(ow);
+    for (int plane = 0; plane < 3; plane++) {
+      for (short row = 0; row < h; row++) {
+	unsigned char *in = input -> color[plane][row];
+	int *dst = &tmp[row * ow];
+	for (short col = 0; col < ow; col++) {
+	  const int *index = &cx.index[col * cx.stride];
+	  const int *weight = &cx.weight[col * cx.stride];
+	  int sum = 0;
+	  for (int t = 0; t < cx.stride; t++) {
+	    sum += in[index[t]] * weight[t];
+	  }
+	  dst[col] = (sum + (1 << (WEIGHT_BITS - INTER_BITS - 1))) >> (WEIGHT_BITS - INTER_BITS);
+	}
+      }
+
+      for (short row = 0; row < oh; row++) {
+	const int *index = &cy.index[row * cy.stride];
+	const int *weight = &cy.weight[row * cy.stride];
+	memset(&acc[0], 0, ow * sizeof(int));
+	for (int t = 0; t < cy.stride; t++) {
+	  if ( weight[t] == 0 ) {
+	    continue;
+	  }
+	  const int *src = &tmp[index[t] * ow];
+	  int wt = weight[t];
+	  for (short col = 0; col < ow; col++) {
+	    acc[col] += src[col] * wt;
+	  }
+	}
+	unsigned char *out = output -> color[plane][row];
+	for (short col = 0; col < ow; col++) {
+	  out[col] = clampPixel((acc[col] + (1 << (WEIGHT_BITS + INTER_BITS - 1)))
+				>> (WEIGHT_BITS + INTER_BITS));
+	}
+      }
+    }
+  }
+}
+
+//
+// Value of the 3x3 convolution at (row, col), or 0 on the border where
+// applyFilter never writes. Only used for the edges of the fused path.
+//
+static int convolvedAt(unsigned char (*in)[MAX_DIM], short w, short h,
+		       int taps[3][3], int div, int row, int col)
+{
+  if ( row < 1 || row > h - 2 || col < 1 || col > w - 2 ) {
+    return 0;
+  }
+  int sum = 0;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      sum += in[row + i - 1][col + j - 1] * taps[i][j];
+    }
+  }
+  return clampPixel(sum / div);
+}
+
+//
+// Blur followed by 2x box decimation. Each output pixel reads the 4x4
+// window under its 2x2 box once and computes the four convolved pixels
+// from it, so the full size intermediate is never written. Each of the
+// four is truncated by the divisor just as applyFilter does, which
+// keeps the result identical to the unfused path.
+//
+void Resample::applyFused(Filter *filter, cs1300bmp *input, cs1300bmp *output)
+{
+  short w = input -> width;
+  short h = input -> height;
+  short ow = w / 2;
+  short oh = h / 2;
+  output -> width = ow;
+  output -> height = oh;
+
+  int div = filter -> getDivisor();
+  FilterDivider divider = filter -> getDivider();
+  int taps[3][3];
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      taps[i][j] = filter -> get(i, j);
+    }
+  }
+
+  //
+  // Output pixels whose whole 2x2 footprint is inside the convolved
+  // region; everything else goes through convolvedAt().
+  //
+  short lo = 1;
+  short rowHi = (h - 3) / 2;
+  short colHi = (w - 3) / 2;
+
+  for (int plane = 0; plane < 3; plane++) {
+    unsigned char (*in)[MAX_DIM] = input -> color[plane];
+    for (short row = 0; row < oh; row++) {
+      unsigned char *out = output -> color[plane][row];
+      bool interiorRow = row >= lo && row <= rowHi;
+      for (short col = 0; col < ow; col++) {
+	if ( interiorRow && col >= lo && col <= colHi ) {
+	  int s00 = 0, s01 = 0, s10 = 0, s11 = 0;
+	  for (int i = 0; i < 3; i++) {
+	    unsigned char *top = &in[2 * row + i - 1][2 * col - 1];
+	    unsigned char *bot = &in[2 * row + i][2 * col - 1];
+	    for (int j = 0; j < 3; j++) {
+	      s00 += top[j] * taps[i][j];
+	      s01 += top[j + 1] * taps[i][j];
+	      s10 += bot[j] * taps[i][j];
+	      s11 += bot[j + 1] * taps[i][j];
+	    }
+	  }
+	  out[col] = (divider.divide(s00) + divider.divide(s01)
+		      + divider.divide(s10) + divider.divide(s11) + 2) >> 2;
+	} else {
+	  int sum = convolvedAt(in, w, h, taps, div, 2 * row, 2 * col)
+	    + convolvedAt(in, w, h, taps, div, 2 * row, 2 * col + 1)
+	    + convolvedAt(in, w, h, taps, div, 2 * row + 1, 2 * col)
+	    + convolvedAt(in, w, h, taps, div, 2 * row + 1, 2 * col + 1);
+	  out[col] = (sum + 2) >> 2;
+	}
+      }
+    }
+  }
+}
@@ -0,0 +1,53 @@
+//-*-c++-*-
+#ifndef _Resample_h_
+#define _Resample_h_
+
+#include <string>
+#include "cs1300bmp.h"
+#include "Filter.h"
+
+using namespace std;
+
+//
+// The resize stages that can run after the convolution
+//
+enum ResampleKind {
+  RESAMPLE_NONE,
+  RESAMPLE_BOX2,      // 2x2 box average, halves both dimensions
+  RESAMPLE_BILINEAR,  // bilinear to an explicit WxH
+  RESAMPLE_LANCZOS    // separable Lanczos-3 to an explicit WxH
+};
+
+class Resample {
+  ResampleKind kind;
+  short outWidth;
+  short outHeight;
+
+public:
+  Resample();
+
+  //
+  // Parse a stage spec: "box2", "bilinear:WxH" or "lanczos:WxH".
+  // Returns false if the spec is not understood.
+  //
+  bool parse(string spec);
+
+  ResampleKind getKind();
+  string getName();
+
+  //
+  // Output dimensions for an input of inW x inH
+  //
+  void outputSize(short inW, short inH, short *outW, short *outH);
+
+  //
+  // True if the convolution can be folded into this stage so that
+  // only the kept output pixels are ever computed.
+  //
+  bool canFuse(Filter *filter);
+
+  void apply(cs1300bmp *input, cs1300bmp *output);
+  void applyFused(Filter *filter, cs1300bmp *input, cs1300bmp *output);
+};
+
+#endif
@@ -0,0 +1,27 @@
+//-*-c++-*-
+#ifndef _RowBand_h_
+#define _RowBand_h_
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//
+// Rows [first, last) split evenly across the threads of the enclosing
+// parallel region; the whole range when there is no OpenMP.
+//
+static inline void
+rowBand(short first, short last, short *bandStart, short *bandEnd) {
+#ifdef _OPENMP
+    int threads = omp_get_num_threads();
+    int id = omp_get_thread_num();
+#else
+    int threads = 1;
+    int id = 0;
+#endif
+    int rows = last - first;
+    *bandStart = first + (rows * id) / threads;
+    *bandEnd = first + (rows * (id + 1)) / threads;
+}
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * libmm.c - the C allocation functions on top of mm.c, built into
+ *     libmm.so so an unmodified program can run on it:
+ *
+ *     LD_PRELOAD=./libmm.so <program> ...
+ *
+ * The heap is memlib's MAX_HEAP reservation and huge blocks get
+ * mappings of their own, as in mdriver. The package is initialized on
+ * the first call, for as many threads as there are CPUs (up to the
+ * arena limit). Requests of 2GB and up fail with ENOMEM. The library
+ * is built with an ALIGNMENT of 16, so payloads meet x86-64's
+ * max_align_t as any malloc's must. A fork while another thread is
+ * inside the allocator isn't handled.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "config.h"
+
+#define MAX_REQUEST ((size_t)1 << 31)
+
+#define EXPORT __attribute__((visibility("default")))
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static int ready;
+
+static void init(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    mem_init();
+    mm_init_threads(cpus > 0 ? (int)cpus : 1);
+    ready = 1;
+}
+
+static inline void start(void)
+{
+    if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE))
+	pthread_once(&once, init);
+}
+
+static void *alloc(size_t size)
+{
+    void *p;
+
+    if (size >= MAX_REQUEST) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    start();
+    if ((p = mm_malloc(size ? size : 1)) == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+EXPORT void *malloc(size_t size)
+{
+    return alloc(size);
+}
+
+EXPORT void free(void *ptr)
+{
+    if (ptr != NULL)
+	mm_free(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    size_t total = nmemb * size;
+    void *p;
+
+    if (size != 0 && nmemb >= MAX_REQUEST / size) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    start();
+    /* mm_calloc only clears what may not be zero already */
+    if ((p = mm_calloc(1, total ? total : 1)) == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    void *p;
+
+    if (ptr == NULL)
+	return alloc(size);
+    if (size == 0) {
+	mm_free(ptr);
+	return NULL;
+    }
+    if (size >= MAX_REQUEST || (p = mm_realloc(ptr, size)) == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return p;
+}
+
+EXPORT void *memalign(size_t align, size_t size)
+{
+    void *p;
+
+    if (align == 0 || (align & (align - 1)) != 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    if (size >= MAX_REQUEST || align >= MAX_REQUEST) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    start();
+    if ((p = mm_memalign(align, size ? size : 1)) == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void *p;
+
+    if (align < sizeof(void *) || (align & (align - 1)) != 0)
+	return EINVAL;
+    if ((p = memalign(align, size)) == NULL)
+	return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    return ptr != NULL ? mm_usable_size(ptr) : 0;
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return memalign(mem_pagesize(), size);
+}
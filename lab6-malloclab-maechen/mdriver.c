@@ -15,11 +15,20 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
 #include "config.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -30,9 +39,11 @@
 #define MAXPATH 1024			/* maximum path length */
 #define HDRLINES 4		   /* number of header lines in a trace file */
 #define LINENUM(i) (i + 5) /* cnvt trace request nums to linenums (origin 1) */
-
-/* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p) ((((uintptr_t)(p)) % ALIGNMENT) == 0)
+#define RESIDENT_INTERVAL 256 /* sample resident heap bytes every this many ops */
+#define THREAD_RUNS 3		  /* -T: best of this many runs per thread count */
+#define HANDOFF_RING 1024	  /* -T: blocks in flight to each freeing thread */
+#define RANGE_POOL 4096		  /* range records per pool allocation */
+#define HEAT_CELLS 512		  /* -F: heap cells across the heat map */
 
 /****************************** 
  * The key compound data types 
@@ -41,24 +52,21 @@
 /* Records the extent of each block's payload */
 typedef struct range_t
 {
-	char *lo;			  /* low payload address */
-	char *hi;			  /* high payload address */
-	struct range_t *next; /* next list element */
+	char *lo;			   /* low payload address */
+	char *hi;			   /* high payload address */
+	unsigned prio;		   /* random treap priority, larger nearer the root */
+	struct range_t *left;  /* payloads below lo */
+	struct range_t *right; /* payloads above hi */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef enum
-{
-	ALLOC,
-	FREE,
-	REALLOC
-} RequestType;
-typedef struct
+/* Range records are carved from these */
+typedef struct range_pool_t
 {
-	RequestType type; /* type of request */
-	int index;		  /* index for free() to use later */
-	int size;		  /* byte size of alloc/realloc request */
-} traceop_t;
+	struct range_pool_t *next;
+	range_t records[RANGE_POOL];
+} range_pool_t;
+
+/* A single trace operation (allocator request) is a traceop_t, see trace.h */
 
 /* Holds the information for one trace file*/
 typedef struct
@@ -68,8 +76,12 @@ typedef struct
 	int num_ops;		 /* number of distinct requests */
 	int weight;			 /* weight for this trace (unused) */
 	traceop_t *ops;		 /* array of requests */
+	void *map;			 /* a binary trace's mapping, which ops points into */
+	size_t map_len;
 	char **blocks;		 /* array of ptrs returned by malloc/realloc... */
 	size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+	int max_batch;		 /* requests in the longest batch */
+	void **batch;		 /* room for a batch's blocks, for mm_batch */
 } trace_t;
 
 /* 
@@ -83,6 +95,17 @@ typedef struct
 	range_t *ranges;
 } speed_t;
 
+/* Latency percentiles of one kind of request */
+typedef struct
+{
+	double count; /* requests timed */
+	double p50;	  /* ns */
+	double p90;
+	double p99;
+	double p999;
+	double max;
+} latency_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct
 {
@@ -93,6 +116,18 @@ typedef struct
 
 	/* defined only for the student malloc package */
 	double util; /* space utilization for this trace (always 0 for libc) */
+	mm_realloc_stats_t realloc; /* mm_realloc counters from the util run */
+	mm_stats_t alloc;			/* mm_stats from the util run */
+	double heap_peak;	   /* bytes, largest heap during the util run */
+	double heap_final;	   /* bytes, heap at the end of the util run */
+	double footprint_peak; /* bytes, largest heap + mappings */
+	double mapped_final;   /* bytes, mappings at the end of the util run */
+	double resident_peak;  /* bytes of heap backed by memory, sampled */
+	double resident_avg;   /* every RESIDENT_INTERVAL ops of the util run */
+	double resident_final;
+
+	/* Per request type latencies in ns, from the -L replay */
+	latency_t latency[REQUEST_TYPES];
 
 	/* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -115,16 +150,24 @@ static const char *default_tracefiles[] = {
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size,
+/* these functions manipulate the range tree */
+static int add_range(range_t **ranges, char *lo, int size, int align,
 					 int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static void map_trace(trace_t *trace, FILE *tracefile, char *path);
+static void alloc_trace_blocks(trace_t *trace);
+static void check_batches(trace_t *trace, char *path);
 static void free_trace(trace_t *trace);
 
+/* The batch calls, for the requests of a batch (see trace.h) */
+static int batch_end(trace_t *trace, int i);
+static int mm_batch(trace_t *trace, char **blocks, void **ptrs, int i, int end);
+static char *alloc_op(traceop_t *op, int libc);
+
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
 static void eval_libc_speed(void *ptr);
@@ -132,11 +175,27 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+						   stats_t *stats);
 static void eval_mm_speed(void *ptr);
 
+/* Timing every request on its own (-L) */
+static void eval_latency(trace_t *trace, int libc, latency_t *lat);
+
+/* Fragmentation timeline of the heap (-F) */
+static void eval_frag(trace_t *trace, char *tracefile, int every);
+
+/* Multithreaded replay of the traces through both packages (-T) */
+static double eval_threads(trace_t *trace, int nthreads, int handoff, int libc);
+static void eval_scaling(char *tracedir, char **tracefiles, int num_tracefiles,
+						 int max_threads, int run_libc);
+
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printrealloc(int n, stats_t *stats);
+static void printalloc(int n, stats_t *stats);
+static void printmemory(int n, stats_t *stats);
+static void printlatency(int n, stats_t *stats, const char *name);
 static void usage(void);
 static void unix_error(const char *msg);
 static void malloc_error(int tracenum, int opnum, const char *msg);
@@ -160,6 +219,9 @@ int main(int argc, char **argv)
 	int team_check = 1; /* If set, check team structure (reset by -a) */
 	int run_libc = 0;	/* If set, run libc malloc (set by -l) */
 	int autograder = 0; /* If set, emit summary info for autograder (-g) */
+	int max_threads = 0; /* If set, also replay on up to this many threads (-T) */
+	int latency = 0;	 /* If set, time each request too (-L) */
+	int frag_every = 0;	 /* If set, walk the heap every so many requests (-F) */
 
 	/* temporaries used to compute the performance index */
 	double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -168,7 +230,7 @@ int main(int argc, char **argv)
 	/* 
      * Read and interpret the command line arguments 
      */
-	while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF)
+	while ((c = getopt(argc, argv, "f:t:T:F:hvVgalL")) != EOF)
 	{
 		switch (c)
 		{
@@ -192,12 +254,31 @@ int main(int argc, char **argv)
 			if (tracedir[strlen(tracedir) - 1] != '/')
 				strcat(tracedir, "/"); /* path always ends with "/" */
 			break;
+		case 'T': /* Replay concurrently on up to this many threads */
+			max_threads = atoi(optarg);
+			if (max_threads < 1)
+			{
+				usage();
+				exit(1);
+			}
+			break;
+		case 'F': /* Fragmentation timeline, a snapshot every so many requests */
+			frag_every = atoi(optarg);
+			if (frag_every < 1)
+			{
+				usage();
+				exit(1);
+			}
+			break;
 		case 'a': /* Don't check team structure */
 			team_check = 0;
 			break;
 		case 'l': /* Run libc malloc */
 			run_libc = 1;
 			break;
+		case 'L': /* Latency percentiles per request type */
+			latency = 1;
+			break;
 		case 'v': /* Print per-trace performance breakdown */
 			verbose = 1;
 			break;
@@ -285,6 +366,8 @@ int main(int argc, char **argv)
 				if (verbose > 1)
 					printf("and performance.\n");
 				libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+				if (latency)
+					eval_latency(trace, 1, libc_stats[i].latency);
 			}
 			free_trace(trace);
 		}
@@ -295,6 +378,8 @@ int main(int argc, char **argv)
 			printf("\nResults for libc malloc:\n");
 			printresults(num_tracefiles, libc_stats);
 		}
+		if (latency)
+			printlatency(num_tracefiles, libc_stats, "libc malloc");
 	}
 
 	/*
@@ -323,12 +408,17 @@ int main(int argc, char **argv)
 		{
 			if (verbose > 1)
 				printf("efficiency, ");
-			mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+			mm_stats[i].util = eval_mm_util(trace, i, &ranges, &mm_stats[i]);
+			mm_realloc_stats(&mm_stats[i].realloc);
 			speed_params.trace = trace;
 			speed_params.ranges = ranges;
 			if (verbose > 1)
 				printf("and performance.\n");
 			mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+			if (latency)
+				eval_latency(trace, 0, mm_stats[i].latency);
+			if (frag_every)
+				eval_frag(trace, tracefiles[i], frag_every);
 		}
 		free_trace(trace);
 	}
@@ -338,6 +428,23 @@ int main(int argc, char **argv)
 	{
 		printf("\nResults for mm malloc:\n");
 		printresults(num_tracefiles, mm_stats);
+		printrealloc(num_tracefiles, mm_stats);
+		printalloc(num_tracefiles, mm_stats);
+		printmemory(num_tracefiles, mm_stats);
+		printf("\n");
+	}
+	if (latency)
+	{
+		printlatency(num_tracefiles, mm_stats, "mm malloc");
+		printf("\n");
+	}
+
+	/*
+	 * Optionally measure how both packages scale with threads
+	 */
+	if (max_threads)
+	{
+		eval_scaling(tracedir, tracefiles, num_tracefiles, max_threads, run_libc);
 		printf("\n");
 	}
 
@@ -398,18 +505,141 @@ int main(int argc, char **argv)
 }
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks.
+ *
+ * The tree is a treap ordered by payload address: a binary search
+ * tree on lo that is also a heap on a random priority, which keeps it
+ * balanced in expectation. Since the payloads in it never overlap,
+ * everything left of a node ends before its lo and everything right
+ * of it starts after its hi, so finding any payload that overlaps a
+ * new one is a single walk down. The records come from a pool carved
+ * RANGE_POOL at a time and recycled through a free list.
  ****************************************************************/
 
+static range_pool_t *range_pools;  /* every pool allocated so far */
+static range_pool_t *range_pool;   /* the pool being carved */
+static int range_pool_used;		   /* records carved from it */
+static range_t *range_free;		   /* recycled records, linked by right */
+static unsigned range_seed = 2463534242u;
+
+/*
+ * new_range - a record from the free list or the pool
+ */
+static range_t *new_range(void)
+{
+	range_t *p;
+
+	if ((p = range_free) != NULL)
+	{
+		range_free = p->right;
+		return p;
+	}
+	if (range_pool == NULL || range_pool_used == RANGE_POOL)
+	{
+		range_pool_t **next = range_pool ? &range_pool->next : &range_pools;
+		if (*next == NULL)
+		{
+			if ((*next = (range_pool_t *)malloc(sizeof(range_pool_t))) == NULL)
+				unix_error("malloc error in new_range");
+			(*next)->next = NULL;
+		}
+		range_pool = *next;
+		range_pool_used = 0;
+	}
+	return &range_pool->records[range_pool_used++];
+}
+
+static range_t *rotate_right(range_t *t)
+{
+	range_t *l = t->left;
+	t->left = l->right;
+	l->right = t;
+	return l;
+}
+
+static range_t *rotate_left(range_t *t)
+{
+	range_t *r = t->right;
+	t->right = r->left;
+	r->left = t;
+	return r;
+}
+
+/*
+ * insert_range - put p in the treap rooted at t, return the new root
+ */
+static range_t *insert_range(range_t *t, range_t *p)
+{
+	if (t == NULL)
+		return p;
+	if (p->lo < t->lo)
+	{
+		t->left = insert_range(t->left, p);
+		if (t->left->prio > t->prio)
+			t = rotate_right(t);
+	}
+	else
+	{
+		t->right = insert_range(t->right, p);
+		if (t->right->prio > t->prio)
+			t = rotate_left(t);
+	}
+	return t;
+}
+
+/*
+ * join_ranges - one treap from two, everything in a below everything in b
+ */
+static range_t *join_ranges(range_t *a, range_t *b)
+{
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+	if (a->prio > b->prio)
+	{
+		a->right = join_ranges(a->right, b);
+		return a;
+	}
+	b->left = join_ranges(a, b->left);
+	return b;
+}
+
+/*
+ * delete_range - take the record starting at lo out of the treap
+ *     rooted at t and recycle it; return the new root
+ */
+static range_t *delete_range(range_t *t, char *lo)
+{
+	range_t *joined;
+
+	if (t == NULL)
+		return NULL;
+	if (lo < t->lo)
+		t->left = delete_range(t->left, lo);
+	else if (lo > t->lo)
+		t->right = delete_range(t->right, lo);
+	else
+	{
+		joined = join_ranges(t->left, t->right);
+		t->right = range_free;
+		range_free = t;
+		return joined;
+	}
+	return t;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
- *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     size bytes at addr lo, which was asked to be align-byte aligned
+ *     (1 for no more than usual). After checking the block for
+ *     correctness, we create a range struct for this block and add it
+ *     to the range tree. 
  */
-static int add_range(range_t **ranges, char *lo, int size,
+static int add_range(range_t **ranges, char *lo, int size, int align,
 					 int tracenum, int opnum)
 {
 	char *hi = lo + size - 1;
@@ -418,30 +648,38 @@ static int add_range(range_t **ranges, char *lo, int size,
 
 	assert(size > 0);
 
-	/* Payload addresses must be ALIGNMENT-byte aligned */
-	if (!IS_ALIGNED(lo))
+	/* Payload addresses must be ALIGNMENT-byte aligned, or more if
+	   the request asked for it */
+	if (align < ALIGNMENT)
+		align = ALIGNMENT;
+	if (((uintptr_t)lo % align) != 0)
 	{
 		snprintf(msg, MAXLINE, "Payload address (%p) not aligned to %d bytes",
-				lo, ALIGNMENT);
+				lo, align);
 		malloc_error(tracenum, opnum, msg);
 		return 0;
 	}
 
-	/* The payload must lie within the extent of the heap */
-	if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-		(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi()))
+	/* The payload must lie within the extent of the heap, or
+	   within one of the mappings handed out by mem_mmap */
+	if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+		 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+		!mem_is_mapped(lo, hi))
 	{
-		snprintf(msg, MAXLINE, "Payload (%p:%p) lies outside heap (%p:%p)",
+		snprintf(msg, MAXLINE, "Payload (%p:%p) lies outside heap (%p:%p) and any mapping",
 				lo, hi, mem_heap_lo(), mem_heap_hi());
 		malloc_error(tracenum, opnum, msg);
 		return 0;
 	}
 
 	/* The payload must not overlap any other payloads */
-	for (p = *ranges; p != NULL; p = p->next)
+	for (p = *ranges; p != NULL;)
 	{
-		if ((lo >= p->lo && lo <= p->hi) ||
-			(hi >= p->lo && hi <= p->hi))
+		if (hi < p->lo)
+			p = p->left;
+		else if (lo > p->hi)
+			p = p->right;
+		else
 		{
 			snprintf(msg, MAXLINE, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
 					lo, hi, p->lo, p->hi);
@@ -452,14 +690,18 @@ static int add_range(range_t **ranges, char *lo, int size,
 
 	/* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
-	if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-		unix_error("malloc error in add_range");
-	p->next = *ranges;
+	p = new_range();
 	p->lo = lo;
 	p->hi = hi;
-	*ranges = p;
+	range_seed ^= range_seed << 13;
+	range_seed ^= range_seed >> 17;
+	range_seed ^= range_seed << 5;
+	p->prio = range_seed;
+	p->left = NULL;
+	p->right = NULL;
+	*ranges = insert_range(*ranges, p);
 	return 1;
 }
 
@@ -468,35 +710,18 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-	range_t *p;
-	range_t **prevpp = ranges;
-
-	for (p = *ranges; p != NULL; p = p->next)
-	{
-		if (p->lo == lo)
-		{
-			*prevpp = p->next;
-			// int size = p->hi - p->lo + 1;
-			free(p);
-			break;
-		}
-		prevpp = &(p->next);
-	}
+	*ranges = delete_range(*ranges, lo);
 }
 
 /*
- * clear_ranges - free all of the range records for a trace 
+ * clear_ranges - drop all of the range records for a trace; the pools
+ *     are kept and carved again from the start
  */
 static void clear_ranges(range_t **ranges)
 {
-	range_t *p;
-	range_t *pnext;
-
-	for (p = *ranges; p != NULL; p = pnext)
-	{
-		pnext = p->next;
-		free(p);
-	}
+	range_pool = NULL;
+	range_pool_used = 0;
+	range_free = NULL;
 	*ranges = NULL;
 }
 
@@ -505,7 +730,8 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory. A binary
+ *     trace is mapped rather than read; see map_trace.
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
@@ -513,7 +739,9 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	trace_t *trace;
 	char type[MAXLINE];
 	char path[MAXPATH];
-	int index, size;
+	char magic[TRACE_MAGIC_LEN];
+	int index, size, n, k;
+	unsigned align;
 	int max_index = 0;
 	int op_index;
 
@@ -523,6 +751,8 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	/* Allocate the trace record */
 	if ((trace = (trace_t *)malloc(sizeof(trace_t))) == NULL)
 		unix_error("malloc 1 failed in read_trance");
+	trace->map = NULL;
+	trace->map_len = 0;
 
 	/* Read the trace file header */
 	int lth = snprintf(path, sizeof(path), "%s%s", tracedir, filename);
@@ -531,6 +761,17 @@ static trace_t *read_trace(char *tracedir, char *filename)
 		snprintf(msg, MAXLINE, "Could not open %500s in read_trace", path);
 		unix_error(msg);
 	}
+	if (fread(magic, 1, TRACE_MAGIC_LEN, tracefile) == TRACE_MAGIC_LEN &&
+		memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0)
+	{
+		map_trace(trace, tracefile, path);
+		fclose(tracefile);
+		alloc_trace_blocks(trace);
+		check_batches(trace, path);
+		return trace;
+	}
+	rewind(tracefile);
+
 	if (1 != fscanf(tracefile, "%d", &(trace->sugg_heapsize)))
 	{
 		unix_error("fscanf of heapsize\n");
@@ -553,15 +794,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
 			 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
 		unix_error("malloc 2 failed in read_trace");
 
-	/* We'll keep an array of pointers to the allocated blocks here... */
-	if ((trace->blocks =
-			 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
-		unix_error("malloc 3 failed in read_trace");
-
-	/* ... along with the corresponding byte sizes of each block */
-	if ((trace->block_sizes =
-			 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
-		unix_error("malloc 4 failed in read_trace");
+	alloc_trace_blocks(trace);
 
 	/* read every request line in the trace file */
 	index = 0;
@@ -576,6 +809,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
 				unix_error("fscanf of allocation");
 			}
 			trace->ops[op_index].type = ALLOC;
+			trace->ops[op_index].more = 0;
 			trace->ops[op_index].index = index;
 			trace->ops[op_index].size = size;
 			max_index = (index > max_index) ? index : max_index;
@@ -586,6 +820,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
 				unix_error("fscanf of relloc");
 			}
 			trace->ops[op_index].type = REALLOC;
+			trace->ops[op_index].more = 0;
 			trace->ops[op_index].index = index;
 			trace->ops[op_index].size = size;
 			max_index = (index > max_index) ? index : max_index;
@@ -596,7 +831,72 @@ static trace_t *read_trace(char *tracedir, char *filename)
 				unix_error("fscanf of free\n");
 			}
 			trace->ops[op_index].type = FREE;
+			trace->ops[op_index].more = 0;
+			trace->ops[op_index].index = index;
+			break;
+		case 's':
+			if (2 != fscanf(tracefile, "%u %u", &index, &size))
+			{
+				unix_error("fscanf of sized free");
+			}
+			trace->ops[op_index].type = FREE_SIZED;
+			trace->ops[op_index].more = 0;
+			trace->ops[op_index].index = index;
+			trace->ops[op_index].size = size;
+			break;
+		case 'A':
+		case 'F':
+			if (1 != fscanf(tracefile, "%u", &n) ||
+				(type[0] == 'A' && 1 != fscanf(tracefile, "%u", &size)))
+			{
+				unix_error("fscanf of batch");
+			}
+			if (n < 1 || n > trace->num_ops - op_index)
+			{
+				printf("Bad batch size %d in tracefile %s\n", n, path);
+				exit(1);
+			}
+			for (k = 0; k < n; k++)
+			{
+				if (1 != fscanf(tracefile, "%u", &index))
+				{
+					unix_error("fscanf of batch");
+				}
+				trace->ops[op_index + k].type = (type[0] == 'A') ? ALLOC_BATCH : FREE_BATCH;
+				trace->ops[op_index + k].more = (k > 0);
+				trace->ops[op_index + k].index = index;
+				trace->ops[op_index + k].size = (type[0] == 'A') ? size : 0;
+				max_index = (index > max_index) ? index : max_index;
+			}
+			op_index += n - 1;
+			break;
+		case 'm':
+			if (3 != fscanf(tracefile, "%u %u %u", &index, &align, &size))
+			{
+				unix_error("fscanf of memalign");
+			}
+			if (align == 0 || (align & (align - 1)) != 0 ||
+				(unsigned)size >= 1u << TRACE_ALIGN_SHIFT)
+			{
+				printf("Bad memalign %u %u in tracefile %s\n", align, size, path);
+				exit(1);
+			}
+			trace->ops[op_index].type = MEMALIGN;
+			trace->ops[op_index].more = 0;
+			trace->ops[op_index].index = index;
+			trace->ops[op_index].size = size | __builtin_ctz(align) << TRACE_ALIGN_SHIFT;
+			max_index = (index > max_index) ? index : max_index;
+			break;
+		case 'c':
+			if (2 != fscanf(tracefile, "%u %u", &index, &size))
+			{
+				unix_error("fscanf of calloc");
+			}
+			trace->ops[op_index].type = CALLOC;
+			trace->ops[op_index].more = 0;
 			trace->ops[op_index].index = index;
+			trace->ops[op_index].size = size;
+			max_index = (index > max_index) ? index : max_index;
 			break;
 		default:
 			printf("Bogus type character (%c) in tracefile %s\n",
@@ -608,19 +908,120 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	fclose(tracefile);
 	assert(max_index == trace->num_ids - 1);
 	assert(trace->num_ops == op_index);
+	check_batches(trace, path);
 
 	return trace;
 }
 
+/*
+ * map_trace - map the binary trace open as tracefile, whose magic has
+ *     already been read. The requests are used in place; the only pass
+ *     over them checks that every id is in range.
+ */
+static void map_trace(trace_t *trace, FILE *tracefile, char *path)
+{
+	struct stat st;
+	trace_header_t *hdr;
+	size_t ops_offset = TRACE_MAGIC_LEN + sizeof(trace_header_t);
+	int i;
+
+	if (fstat(fileno(tracefile), &st) < 0)
+		unix_error("fstat failed in map_trace");
+	if ((size_t)st.st_size < ops_offset)
+	{
+		printf("Truncated binary tracefile %s\n", path);
+		exit(1);
+	}
+	trace->map_len = st.st_size;
+	trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE, fileno(tracefile), 0);
+	if (trace->map == MAP_FAILED)
+		unix_error("mmap failed in map_trace");
+
+	hdr = (trace_header_t *)((char *)trace->map + TRACE_MAGIC_LEN);
+	trace->sugg_heapsize = hdr->sugg_heapsize;
+	trace->num_ids = hdr->num_ids;
+	trace->num_ops = hdr->num_ops;
+	trace->weight = hdr->weight;
+	trace->ops = (traceop_t *)((char *)trace->map + ops_offset);
+
+	if (trace->num_ops < 0 || trace->num_ids < 0 ||
+		ops_offset + (size_t)trace->num_ops * sizeof(traceop_t) != trace->map_len)
+	{
+		printf("Binary tracefile %s does not hold %d requests\n", path, trace->num_ops);
+		exit(1);
+	}
+	for (i = 0; i < trace->num_ops; i++)
+	{
+		if (trace->ops[i].index >= (uint32_t)trace->num_ids ||
+			trace->ops[i].type >= REQUEST_TYPES)
+		{
+			printf("Bad request %d in binary tracefile %s\n", i, path);
+			exit(1);
+		}
+	}
+}
+
+/*
+ * alloc_trace_blocks - the per-id block pointer and size arrays
+ */
+static void alloc_trace_blocks(trace_t *trace)
+{
+	/* We'll keep an array of pointers to the allocated blocks here... */
+	if ((trace->blocks =
+			 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+		unix_error("malloc 3 failed in read_trace");
+
+	/* ... along with the corresponding byte sizes of each block */
+	if ((trace->block_sizes =
+			 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+		unix_error("malloc 4 failed in read_trace");
+}
+
+/*
+ * check_batches - check that each request marked as continuing a batch
+ *     follows one of the same batch (for the same size, if an
+ *     allocation), and make room for the longest batch
+ */
+static void check_batches(trace_t *trace, char *path)
+{
+	traceop_t *ops = trace->ops;
+	int i, n = 0;
+
+	trace->max_batch = 0;
+	for (i = 0; i < trace->num_ops; i++)
+	{
+		if (!ops[i].more)
+			n = 1;
+		else if (i > 0 && ops[i].type == ops[i - 1].type &&
+				 (ops[i].type == FREE_BATCH ||
+				  (ops[i].type == ALLOC_BATCH && ops[i].size == ops[i - 1].size)))
+			n++;
+		else
+		{
+			printf("Bad batch at request %d in tracefile %s\n", i, path);
+			exit(1);
+		}
+		if (n > trace->max_batch)
+			trace->max_batch = n;
+	}
+
+	if ((trace->batch = (void **)malloc((trace->max_batch + 1) * sizeof(void *))) == NULL)
+		unix_error("malloc failed in check_batches");
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated (or mapped) in read_trace().
  */
 void free_trace(trace_t *trace)
 {
-	free(trace->ops); /* free the three arrays... */
+	if (trace->map) /* free the three arrays... */
+		munmap(trace->map, trace->map_len);
+	else
+		free(trace->ops);
 	free(trace->blocks);
 	free(trace->block_sizes);
+	free(trace->batch);
 	free(trace); /* and the trace record itself... */
 }
 
@@ -629,12 +1030,72 @@ void free_trace(trace_t *trace)
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * batch_end - one past the last request of the batch that starts at i
+ */
+static int batch_end(trace_t *trace, int i)
+{
+	while (++i < trace->num_ops && trace->ops[i].more)
+		;
+	return i;
+}
+
+/*
+ * mm_batch - make the one mm_malloc_batch or mm_free_batch call for
+ *     the batch of requests [i, end), with the blocks in blocks[] and
+ *     ptrs[] to pass them in; 0 if mm_malloc_batch fails
+ */
+static int mm_batch(trace_t *trace, char **blocks, void **ptrs, int i, int end)
+{
+	int j, n = end - i;
+
+	if (trace->ops[i].type == ALLOC_BATCH)
+	{
+		if (mm_malloc_batch(trace->ops[i].size, n, ptrs) != n)
+			return 0;
+		for (j = 0; j < n; j++)
+			blocks[trace->ops[i + j].index] = ptrs[j];
+	}
+	else
+	{
+		for (j = 0; j < n; j++)
+			ptrs[j] = blocks[trace->ops[i + j].index];
+		mm_free_batch(ptrs, n);
+	}
+	return 1;
+}
+
+/*
+ * alloc_op - make the call for an ALLOC, MEMALIGN or CALLOC request,
+ *     to the mm package or to libc; NULL if it fails
+ */
+static char *alloc_op(traceop_t *op, int libc)
+{
+	uint32_t size = TRACE_SIZE(*op);
+	size_t align = TRACE_ALIGN(*op);
+	void *p;
+
+	switch (op->type)
+	{
+	case MEMALIGN:
+		if (!libc)
+			return mm_memalign(align, size);
+		if (align < sizeof(void *))
+			align = sizeof(void *);
+		return posix_memalign(&p, align, size) == 0 ? p : NULL;
+	case CALLOC:
+		return libc ? calloc(1, size) : mm_calloc(1, size);
+	default:
+		return libc ? malloc(size) : mm_malloc(size);
+	}
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 {
-	int i, j;
+	int i, j, end;
 	int index;
 	int size;
 	int oldsize;
@@ -642,8 +1103,11 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	char *oldp;
 	char *p;
 
-	/* Reset the heap and free any records in the range list */
+	/* Reset the heap and free any records in the range tree. The heap
+	   is released too, so mm_calloc can count on fresh memory reading
+	   as zeros, which the CALLOC requests then check. */
 	mem_reset_brk();
+	mem_release(mem_heap_lo(), MAX_HEAP);
 	clear_ranges(ranges);
 
 	/* Call the mm package's init function */
@@ -657,15 +1121,17 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	for (i = 0; i < trace->num_ops; i++)
 	{
 		index = trace->ops[i].index;
-		size = trace->ops[i].size;
+		size = TRACE_SIZE(trace->ops[i]);
 
 		switch (trace->ops[i].type)
 		{
 
-		case ALLOC: /* mm_malloc */
+		case ALLOC:	   /* mm_malloc */
+		case MEMALIGN: /* mm_memalign */
+		case CALLOC:   /* mm_calloc */
 
 			/* Call the student's malloc */
-			if ((p = (char *)mm_malloc(size)) == NULL)
+			if ((p = alloc_op(&trace->ops[i], 0)) == NULL)
 			{
 				malloc_error(tracenum, i, "mm_malloc failed.");
 				return 0;
@@ -673,12 +1139,22 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 
 			/* 
 	     * Test the range of the new block for correctness and add it 
-	     * to the range list if OK. The block must be  be aligned properly,
+	     * to the range tree if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */
-			if (add_range(ranges, p, size, tracenum, i) == 0)
+			if (add_range(ranges, p, size, TRACE_ALIGN(trace->ops[i]), tracenum, i) == 0)
 				return 0;
 
+			/* A calloc'd block must come zeroed */
+			for (j = 0; trace->ops[i].type == CALLOC && j < size; j++)
+			{
+				if (p[j] != 0)
+				{
+					malloc_error(tracenum, i, "mm_calloc did not zero the block");
+					return 0;
+				}
+			}
+
 			/* ADDED: cgw
 	     * fill range with low byte of index.  This will be used later
 	     * if we realloc the block and wish to make sure that the old
@@ -701,11 +1177,11 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 				return 0;
 			}
 
-			/* Remove the old region from the range list */
+			/* Remove the old region from the range tree */
 			remove_range(ranges, oldp);
 
-			/* Check new block for correctness and add it to range list */
-			if (add_range(ranges, newp, size, tracenum, i) == 0)
+			/* Check new block for correctness and add it to range tree */
+			if (add_range(ranges, newp, size, 1, tracenum, i) == 0)
 				return 0;
 
 			/* ADDED: cgw
@@ -718,7 +1194,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 				oldsize = size;
 			for (j = 0; j < oldsize; j++)
 			{
-				if (newp[j] != (index & 0xFF))
+				if ((unsigned char)newp[j] != (index & 0xFF))
 				{
 					malloc_error(tracenum, i, "mm_realloc did not preserve the "
 											  "data from old block");
@@ -740,6 +1216,46 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 			mm_free(p);
 			break;
 
+		case FREE_SIZED: /* mm_free_sized */
+			if ((size_t)size != trace->block_sizes[index])
+			{
+				malloc_error(tracenum, i, "the trace frees a block with the wrong size.");
+				return 0;
+			}
+			p = trace->blocks[index];
+			remove_range(ranges, p);
+			mm_free_sized(p, size);
+			break;
+
+		case ALLOC_BATCH: /* mm_malloc_batch */
+
+			/* Every block of the batch gets the checks of mm_malloc's */
+			end = batch_end(trace, i);
+			if (!mm_batch(trace, trace->blocks, trace->batch, i, end))
+			{
+				malloc_error(tracenum, i, "mm_malloc_batch failed.");
+				return 0;
+			}
+			for (j = i; j < end; j++)
+			{
+				index = trace->ops[j].index;
+				p = trace->blocks[index];
+				if (add_range(ranges, p, size, 1, tracenum, j) == 0)
+					return 0;
+				memset(p, index & 0xFF, size);
+				trace->block_sizes[index] = size;
+			}
+			i = end - 1;
+			break;
+
+		case FREE_BATCH: /* mm_free_batch */
+			end = batch_end(trace, i);
+			for (j = i; j < end; j++)
+				remove_range(ranges, trace->blocks[trace->ops[j].index]);
+			mm_batch(trace, trace->blocks, trace->batch, i, end);
+			i = end - 1;
+			break;
+
 		default:
 			app_error("Nonexistent request type in eval_mm_valid");
 		}
@@ -754,37 +1270,56 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
- *   
+ *   high water mark of the student's heap plus mem_mmap mappings in
+ *   bytes while running the trace. mem_sbrk() lets the brk go back
+ *   down, so that is not necessarily where the heap ends up.
+ *
+ *   Along the way we sample how much of the heap is resident, which is
+ *   where trimming and releasing free memory shows up.
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+						   stats_t *stats)
 {
-	int i;
+	int i, j, end;
 	int index;
 	int size, newsize, oldsize;
 	int max_total_size = 0;
 	int total_size = 0;
 	char *p;
 	char *newp, *oldp;
+	double resident;
+	int samples = 0;
 
-	/* initialize the heap and the mm malloc package */
+	/* initialize the heap and the mm malloc package, starting with
+	   nothing resident from the runs before this one */
 	mem_reset_brk();
+	mem_release(mem_heap_lo(), MAX_HEAP);
 	if (mm_init() < 0)
 		app_error("mm_init failed in eval_mm_util");
 
+	stats->resident_peak = 0;
+	stats->resident_avg = 0;
 	for (i = 0; i < trace->num_ops; i++)
 	{
+		if (i % RESIDENT_INTERVAL == 0)
+		{
+			resident = mem_resident(mem_heap_peak());
+			if (resident > stats->resident_peak)
+				stats->resident_peak = resident;
+			stats->resident_avg += resident;
+			samples++;
+		}
+
 		switch (trace->ops[i].type)
 		{
 
-		case ALLOC: /* mm_alloc */
+		case ALLOC:	   /* mm_alloc */
+		case MEMALIGN: /* mm_memalign */
+		case CALLOC:   /* mm_calloc */
 			index = trace->ops[i].index;
-			size = trace->ops[i].size;
+			size = TRACE_SIZE(trace->ops[i]);
 
-			if ((p = (char *)mm_malloc(size)) == NULL)
+			if ((p = alloc_op(&trace->ops[i], 0)) == NULL)
 				app_error("mm_malloc failed in eval_mm_util");
 
 			/* Remember region and size */
@@ -833,12 +1368,52 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 
 			break;
 
+		case FREE_SIZED: /* mm_free_sized */
+			index = trace->ops[i].index;
+			size = trace->block_sizes[index];
+			mm_free_sized(trace->blocks[index], size);
+			total_size -= size;
+			break;
+
+		case ALLOC_BATCH: /* mm_malloc_batch */
+		case FREE_BATCH:  /* mm_free_batch */
+			end = batch_end(trace, i);
+			if (!mm_batch(trace, trace->blocks, trace->batch, i, end))
+				app_error("mm_malloc_batch failed in eval_mm_util");
+			for (j = i; j < end; j++)
+			{
+				index = trace->ops[j].index;
+				if (trace->ops[j].type == ALLOC_BATCH)
+				{
+					size = trace->ops[j].size;
+					trace->block_sizes[index] = size;
+					total_size += size;
+				}
+				else
+					total_size -= trace->block_sizes[index];
+			}
+			max_total_size = (total_size > max_total_size) ? total_size : max_total_size;
+			i = end - 1;
+			break;
+
 		default:
 			app_error("Nonexistent request type in eval_mm_util");
 		}
 	}
 
-	return ((double)max_total_size / (double)mem_heapsize());
+	resident = mem_resident(mem_heap_peak());
+	if (resident > stats->resident_peak)
+		stats->resident_peak = resident;
+	stats->resident_avg = (stats->resident_avg + resident) / (samples + 1);
+	stats->resident_final = resident;
+	stats->heap_peak = mem_heap_peak();
+	stats->heap_final = mem_heapsize();
+
+	stats->footprint_peak = mem_footprint_peak();
+	stats->mapped_final = mem_mapped_bytes();
+	mm_stats(&stats->alloc);
+
+	return ((double)max_total_size / (double)mem_footprint_peak());
 }
 
 /*
@@ -847,7 +1422,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-	int i, index, size, newsize;
+	int i, index, newsize, end;
 	char *p, *newp, *oldp, *block;
 	trace_t *trace = ((speed_t *)ptr)->trace;
 
@@ -861,10 +1436,11 @@ static void eval_mm_speed(void *ptr)
 		switch (trace->ops[i].type)
 		{
 
-		case ALLOC: /* mm_malloc */
+		case ALLOC:	   /* mm_malloc */
+		case MEMALIGN: /* mm_memalign */
+		case CALLOC:   /* mm_calloc */
 			index = trace->ops[i].index;
-			size = trace->ops[i].size;
-			if ((p = (char *)mm_malloc(size)) == NULL)
+			if ((p = alloc_op(&trace->ops[i], 0)) == NULL)
 				app_error("mm_malloc error in eval_mm_speed");
 			trace->blocks[index] = p;
 			break;
@@ -884,6 +1460,19 @@ static void eval_mm_speed(void *ptr)
 			mm_free(block);
 			break;
 
+		case FREE_SIZED: /* mm_free_sized */
+			index = trace->ops[i].index;
+			mm_free_sized(trace->blocks[index], trace->ops[i].size);
+			break;
+
+		case ALLOC_BATCH: /* mm_malloc_batch */
+		case FREE_BATCH:  /* mm_free_batch */
+			end = batch_end(trace, i);
+			if (!mm_batch(trace, trace->blocks, trace->batch, i, end))
+				app_error("mm_malloc_batch error in eval_mm_speed");
+			i = end - 1;
+			break;
+
 		default:
 			app_error("Nonexistent request type in eval_mm_valid");
 		}
@@ -906,7 +1495,10 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 		{
 
 		case ALLOC: /* malloc */
-			if ((p = (char *)malloc(trace->ops[i].size)) == NULL)
+		case ALLOC_BATCH:
+		case MEMALIGN:
+		case CALLOC:
+			if ((p = alloc_op(&trace->ops[i], 1)) == NULL)
 			{
 				malloc_error(tracenum, i, "libc malloc failed");
 				unix_error("System message");
@@ -926,6 +1518,8 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 			break;
 
 		case FREE: /* free */
+		case FREE_SIZED:
+		case FREE_BATCH:
 			free(trace->blocks[trace->ops[i].index]);
 			break;
 
@@ -945,7 +1539,7 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 static void eval_libc_speed(void *ptr)
 {
 	int i;
-	int index, size, newsize;
+	int index, newsize;
 	char *p, *newp, *oldp, *block;
 	trace_t *trace = ((speed_t *)ptr)->trace;
 
@@ -954,9 +1548,11 @@ static void eval_libc_speed(void *ptr)
 		switch (trace->ops[i].type)
 		{
 		case ALLOC: /* malloc */
+		case ALLOC_BATCH:
+		case MEMALIGN:
+		case CALLOC:
 			index = trace->ops[i].index;
-			size = trace->ops[i].size;
-			if ((p = (char *)malloc(size)) == NULL)
+			if ((p = alloc_op(&trace->ops[i], 1)) == NULL)
 				unix_error("malloc failed in eval_libc_speed");
 			trace->blocks[index] = p;
 			break;
@@ -972,6 +1568,8 @@ static void eval_libc_speed(void *ptr)
 			break;
 
 		case FREE: /* free */
+		case FREE_SIZED:
+		case FREE_BATCH:
 			index = trace->ops[i].index;
 			block = trace->blocks[index];
 			free(block);
@@ -980,17 +1578,687 @@ static void eval_libc_speed(void *ptr)
 	}
 }
 
-/*************************************
- * Some miscellaneous helper routines
- ************************************/
-
 /*
- * printresults - prints a performance summary for some malloc package
+ * The latency mode (-L). One more replay of the trace with every call
+ * timed on its own by the cycle counter (a batch is one call to mm_*
+ * but a call per block to libc). The times go into HDR style
+ * histograms, one per request type: HIST_SUB linear buckets for each
+ * power of two, so every bucket is within 1/HIST_SUB of the values in
+ * it, whatever their size.
  */
-static void printresults(int n, stats_t *stats)
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct
 {
-	int i;
-	double secs = 0;
+	uint64_t count[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+} hist_t;
+
+static double cycles_per_ns; /* set by calibrate_cycles */
+
+static inline uint64_t read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+/*
+ * calibrate_cycles - cycles per nanosecond, measured over 20 ms
+ */
+static void calibrate_cycles(void)
+{
+	struct timespec start, now;
+	uint64_t c0, c1;
+	double ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	c0 = read_cycles();
+	do
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ns = (now.tv_sec - start.tv_sec) * 1e9 + (now.tv_nsec - start.tv_nsec);
+	} while (ns < 20e6);
+	c1 = read_cycles();
+	cycles_per_ns = (c1 - c0) / ns;
+}
+
+static inline int hist_bucket(uint64_t v)
+{
+	int shift;
+
+	if (v < HIST_SUB)
+		return v;
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+/* The largest value that lands in bucket b */
+static uint64_t hist_high(int b)
+{
+	int shift;
+
+	if (b < HIST_SUB)
+		return b;
+	shift = b / HIST_SUB - 1;
+	return (((uint64_t)(HIST_SUB + b % HIST_SUB) + 1) << shift) - 1;
+}
+
+static inline void hist_add(hist_t *h, uint64_t v)
+{
+	h->count[hist_bucket(v)]++;
+	h->total++;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* The value (in cycles) at or below which a fraction q of the samples fall */
+static uint64_t hist_quantile(hist_t *h, double q)
+{
+	uint64_t want = (uint64_t)(q * h->total + 0.5);
+	uint64_t seen = 0;
+	int b;
+
+	if (want == 0)
+		want = 1;
+	for (b = 0; b < HIST_BUCKETS; b++)
+	{
+		seen += h->count[b];
+		if (seen >= want)
+			return hist_high(b) < h->max ? hist_high(b) : h->max;
+	}
+	return h->max;
+}
+
+/*
+ * eval_latency - replay the trace once through mm_* (after a fresh
+ *    mm_init) or libc, timing each call, and summarize the times per
+ *    request type in lat[]
+ */
+static void eval_latency(trace_t *trace, int libc, latency_t *lat)
+{
+	hist_t *hist;
+	uint64_t t0, t1;
+	char *p;
+	int i, type, end, ok;
+
+	if (cycles_per_ns == 0)
+		calibrate_cycles();
+	if ((hist = (hist_t *)calloc(REQUEST_TYPES, sizeof(hist_t))) == NULL)
+		unix_error("calloc failed in eval_latency");
+
+	if (!libc)
+	{
+		mem_reset_brk();
+		if (mm_init() < 0)
+			app_error("mm_init failed in eval_latency");
+	}
+
+	for (i = 0; i < trace->num_ops; i++)
+	{
+		int index = trace->ops[i].index;
+		int size = TRACE_SIZE(trace->ops[i]);
+
+		switch (trace->ops[i].type)
+		{
+		case ALLOC:
+		case MEMALIGN:
+		case CALLOC:
+			t0 = read_cycles();
+			p = alloc_op(&trace->ops[i], libc);
+			t1 = read_cycles();
+			if (p == NULL)
+				app_error("malloc failed in eval_latency");
+			trace->blocks[index] = p;
+			break;
+
+		case REALLOC:
+			t0 = read_cycles();
+			p = libc ? realloc(trace->blocks[index], size) : mm_realloc(trace->blocks[index], size);
+			t1 = read_cycles();
+			if (p == NULL)
+				app_error("realloc failed in eval_latency");
+			trace->blocks[index] = p;
+			break;
+
+		case FREE:
+			p = trace->blocks[index];
+			t0 = read_cycles();
+			if (libc)
+				free(p);
+			else
+				mm_free(p);
+			t1 = read_cycles();
+			break;
+
+		case FREE_SIZED:
+			p = trace->blocks[index];
+			t0 = read_cycles();
+			if (libc)
+				free(p);
+			else
+				mm_free_sized(p, size);
+			t1 = read_cycles();
+			break;
+
+		case ALLOC_BATCH:
+		case FREE_BATCH:
+			if (libc)
+			{
+				t0 = read_cycles();
+				if (trace->ops[i].type == ALLOC_BATCH)
+				{
+					if ((p = malloc(size)) == NULL)
+						app_error("malloc failed in eval_latency");
+					trace->blocks[index] = p;
+				}
+				else
+					free(trace->blocks[index]);
+				t1 = read_cycles();
+				break;
+			}
+			end = batch_end(trace, i);
+			t0 = read_cycles();
+			ok = mm_batch(trace, trace->blocks, trace->batch, i, end);
+			t1 = read_cycles();
+			if (!ok)
+				app_error("mm_malloc_batch failed in eval_latency");
+			i = end - 1;
+			break;
+
+		default:
+			app_error("Nonexistent request type in eval_latency");
+		}
+		hist_add(&hist[trace->ops[i].type], t1 - t0);
+	}
+
+	for (type = 0; type < REQUEST_TYPES; type++)
+	{
+		hist_t *h = &hist[type];
+		lat[type].count = h->total;
+		lat[type].p50 = hist_quantile(h, 0.50) / cycles_per_ns;
+		lat[type].p90 = hist_quantile(h, 0.90) / cycles_per_ns;
+		lat[type].p99 = hist_quantile(h, 0.99) / cycles_per_ns;
+		lat[type].p999 = hist_quantile(h, 0.999) / cycles_per_ns;
+		lat[type].max = h->max / cycles_per_ns;
+	}
+	free(hist);
+}
+
+/*
+ * The fragmentation timeline (-F). One more replay of the trace through
+ * mm_*, stopping every so many requests (and at the end) to walk the
+ * heap. Each stop is a line of <trace>.frag.csv: the heap and payload
+ * sizes, the free blocks, the external fragmentation (the share of the
+ * free bytes outside the largest free block) and the free bytes in
+ * each size class a block of the heap could be in. It is also a row of
+ * <trace>.heat.pgm, a greyscale map of the heap as high as it gets in
+ * the trace, split into HEAT_CELLS cells, with each cell as bright as
+ * the share of it that is allocated. Both files go in the current
+ * directory.
+ */
+
+/*
+ * frag_replay - run requests [from, to) of the trace, and the rest of
+ *    a batch that to would split, keeping live up to date; returns
+ *    where it stopped
+ */
+static int frag_replay(trace_t *trace, int from, int to, uint64_t *live)
+{
+	int i, j, end;
+
+	for (i = from; i < to; i++)
+	{
+		int index = trace->ops[i].index;
+		int size = TRACE_SIZE(trace->ops[i]);
+		char *p;
+
+		switch (trace->ops[i].type)
+		{
+		case ALLOC:
+		case MEMALIGN:
+		case CALLOC:
+			if ((p = alloc_op(&trace->ops[i], 0)) == NULL)
+				app_error("mm_malloc failed in eval_frag");
+			trace->blocks[index] = p;
+			trace->block_sizes[index] = size;
+			*live += size;
+			break;
+
+		case REALLOC:
+			if ((p = mm_realloc(trace->blocks[index], size)) == NULL)
+				app_error("mm_realloc failed in eval_frag");
+			trace->blocks[index] = p;
+			*live += size - trace->block_sizes[index];
+			trace->block_sizes[index] = size;
+			break;
+
+		case FREE:
+			mm_free(trace->blocks[index]);
+			*live -= trace->block_sizes[index];
+			break;
+
+		case FREE_SIZED:
+			mm_free_sized(trace->blocks[index], size);
+			*live -= size;
+			break;
+
+		case ALLOC_BATCH:
+		case FREE_BATCH:
+			end = batch_end(trace, i);
+			if (!mm_batch(trace, trace->blocks, trace->batch, i, end))
+				app_error("mm_malloc_batch failed in eval_frag");
+			for (j = i; j < end; j++)
+			{
+				index = trace->ops[j].index;
+				if (trace->ops[j].type == ALLOC_BATCH)
+				{
+					trace->block_sizes[index] = size;
+					*live += size;
+				}
+				else
+					*live -= trace->block_sizes[index];
+			}
+			i = end - 1;
+			break;
+
+		default:
+			app_error("Nonexistent request type in eval_frag");
+		}
+	}
+	return i;
+}
+
+/*
+ * eval_frag - write the fragmentation timeline of the trace, with a
+ *    snapshot every so many requests
+ */
+static void eval_frag(trace_t *trace, char *tracefile, int every)
+{
+	char name[MAXPATH], csvpath[MAXLINE], pgmpath[MAXLINE];
+	char *base, *dot;
+	FILE *csv, *pgm;
+	mm_heapwalk_t walk;
+	uint32_t heat[HEAT_CELLS];
+	unsigned char row[HEAT_CELLS];
+	uint32_t floors[MM_CLASSES];
+	uint64_t live = 0, cell_bytes;
+	size_t peak;
+	int i, next, cls, rows = 0;
+
+	/*
+	 * A first replay finds how high the heap goes, for the heat map,
+	 * and how many snapshots there will be
+	 */
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in eval_frag");
+	for (i = 0; i < trace->num_ops; rows++)
+		i = frag_replay(trace, i, (trace->num_ops - i > every) ? i + every : trace->num_ops, &live);
+	peak = mem_heap_peak();
+	cell_bytes = (peak + HEAT_CELLS - 1) / HEAT_CELLS;
+	if (cell_bytes == 0)
+		cell_bytes = 1;
+
+	base = strrchr(tracefile, '/') ? strrchr(tracefile, '/') + 1 : tracefile;
+	snprintf(name, sizeof(name), "%s", base);
+	if ((dot = strrchr(name, '.')) != NULL && dot != name)
+		*dot = '\0';
+	snprintf(csvpath, sizeof(csvpath), "%s.frag.csv", name);
+	snprintf(pgmpath, sizeof(pgmpath), "%s.heat.pgm", name);
+	if ((csv = fopen(csvpath, "w")) == NULL || (pgm = fopen(pgmpath, "wb")) == NULL)
+		unix_error("can't create the -F output files");
+
+	fprintf(csv, "ops,heap_bytes,mapped_bytes,live_bytes,free_blocks,free_bytes,"
+				 "largest_free,ext_frag,util");
+	for (cls = 0; cls < MM_CLASSES; cls++)
+	{
+		floors[cls] = mm_class_floor(cls);
+		if (floors[cls] != 0 && floors[cls] <= peak)
+			fprintf(csv, ",free_%u", floors[cls]);
+	}
+	fprintf(csv, "\n");
+	fprintf(pgm, "P5\n%d %d\n255\n", HEAT_CELLS, rows);
+
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in eval_frag");
+	live = 0;
+	for (i = 0; i < trace->num_ops; i = next)
+	{
+		size_t heap, mapped;
+		int c;
+
+		next = frag_replay(trace, i, (trace->num_ops - i > every) ? i + every : trace->num_ops, &live);
+		mm_heapwalk(&walk, heat, HEAT_CELLS, cell_bytes);
+		heap = mem_heapsize();
+		mapped = mem_mapped_bytes();
+
+		fprintf(csv, "%d,%zu,%zu,%llu,%u,%llu,%u,%.4f,%.4f", next, heap, mapped,
+				(unsigned long long)live, walk.free_blocks,
+				(unsigned long long)walk.free_bytes, walk.largest_free,
+				walk.free_bytes ? 1.0 - (double)walk.largest_free / walk.free_bytes : 0.0,
+				heap + mapped ? (double)live / (heap + mapped) : 0.0);
+		for (cls = 0; cls < MM_CLASSES; cls++)
+			if (floors[cls] != 0 && floors[cls] <= peak)
+				fprintf(csv, ",%llu", (unsigned long long)walk.class_bytes[cls]);
+		fprintf(csv, "\n");
+
+		for (c = 0; c < HEAT_CELLS; c++)
+			row[c] = (unsigned char)(255 * (uint64_t)heat[c] / cell_bytes);
+		fwrite(row, 1, HEAT_CELLS, pgm);
+	}
+
+	if (fclose(csv) != 0 || fclose(pgm) != 0)
+		unix_error("short write of the -F output files");
+	if (verbose)
+		printf("Wrote %s and %s\n", csvpath, pgmpath);
+}
+
+/*
+ * The multithreaded replay (-T). Every thread replays its own copy of
+ * the trace into its own blocks array. With handoff, each replaying
+ * thread passes the blocks it would free to a partner thread over a
+ * ring, so every block is freed on a different thread from the one
+ * that allocated it.
+ */
+typedef struct
+{
+	char *slot[HANDOFF_RING];
+	unsigned head; /* next slot the consumer takes, atomic */
+	unsigned tail; /* next slot the producer fills, atomic */
+} ring_t;
+
+typedef struct
+{
+	trace_t *trace;
+	char **blocks; /* this copy's blocks */
+	void **batch;  /* ...and room for a batch of them */
+	int libc;	   /* replay through libc rather than mm_* */
+	ring_t *ring;  /* handoff: where the frees go, else NULL */
+	pthread_t tid;
+	pthread_t partner;
+} replay_t;
+
+static void ring_put(ring_t *ring, char *p)
+{
+	unsigned tail = ring->tail;
+
+	while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == HANDOFF_RING)
+		sched_yield();
+	ring->slot[tail % HANDOFF_RING] = p;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static char *ring_get(ring_t *ring)
+{
+	unsigned head = ring->head;
+	char *p;
+
+	while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head)
+		sched_yield();
+	p = ring->slot[head % HANDOFF_RING];
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return p;
+}
+
+/*
+ * replay_thread - replay one copy of the trace; a NULL on the ring
+ *    tells the partner there is nothing more to free
+ */
+static void *replay_thread(void *arg)
+{
+	replay_t *r = (replay_t *)arg;
+	trace_t *trace = r->trace;
+	char **blocks = r->blocks;
+	char *p;
+	int i, end;
+
+	for (i = 0; i < trace->num_ops; i++)
+	{
+		int index = trace->ops[i].index;
+		int size = TRACE_SIZE(trace->ops[i]);
+
+		switch (trace->ops[i].type)
+		{
+		case ALLOC:
+		case MEMALIGN:
+		case CALLOC:
+			p = alloc_op(&trace->ops[i], r->libc);
+			if (p == NULL)
+				app_error("malloc failed in replay_thread");
+			blocks[index] = p;
+			break;
+
+		case REALLOC:
+			p = r->libc ? realloc(blocks[index], size) : mm_realloc(blocks[index], size);
+			if (p == NULL)
+				app_error("realloc failed in replay_thread");
+			blocks[index] = p;
+			break;
+
+		case FREE:
+			if (r->ring)
+				ring_put(r->ring, blocks[index]);
+			else if (r->libc)
+				free(blocks[index]);
+			else
+				mm_free(blocks[index]);
+			break;
+
+		case FREE_SIZED:
+			if (r->ring)
+				ring_put(r->ring, blocks[index]);
+			else if (r->libc)
+				free(blocks[index]);
+			else
+				mm_free_sized(blocks[index], size);
+			break;
+
+		/* The blocks of a batch go to the partner, and to libc, one by one */
+		case ALLOC_BATCH:
+		case FREE_BATCH:
+			if (r->libc || (r->ring && trace->ops[i].type == FREE_BATCH))
+			{
+				if (trace->ops[i].type == FREE_BATCH)
+				{
+					if (r->ring)
+						ring_put(r->ring, blocks[index]);
+					else
+						free(blocks[index]);
+				}
+				else if ((blocks[index] = malloc(size)) == NULL)
+					app_error("malloc failed in replay_thread");
+				break;
+			}
+			end = batch_end(trace, i);
+			if (!mm_batch(trace, blocks, r->batch, i, end))
+				app_error("mm_malloc_batch failed in replay_thread");
+			i = end - 1;
+			break;
+		}
+	}
+	if (r->ring)
+		ring_put(r->ring, NULL);
+	return NULL;
+}
+
+/*
+ * free_thread - the handoff partner: free whatever comes off the ring
+ */
+static void *free_thread(void *arg)
+{
+	replay_t *r = (replay_t *)arg;
+	char *p;
+
+	while ((p = ring_get(r->ring)) != NULL)
+	{
+		if (r->libc)
+			free(p);
+		else
+			mm_free(p);
+	}
+	return NULL;
+}
+
+/*
+ * eval_threads - wall clock seconds for nthreads concurrent copies of
+ *    the trace, the best of THREAD_RUNS runs. The mm package gets one
+ *    arena per thread.
+ */
+static double eval_threads(trace_t *trace, int nthreads, int handoff, int libc)
+{
+	replay_t *r;
+	double best = DBL_MAX;
+	int run, t;
+
+	if ((r = (replay_t *)calloc(nthreads, sizeof(replay_t))) == NULL)
+		unix_error("calloc failed in eval_threads");
+	for (t = 0; t < nthreads; t++)
+	{
+		r[t].trace = trace;
+		r[t].libc = libc;
+		if ((r[t].blocks = (char **)malloc(trace->num_ids * sizeof(char *))) == NULL ||
+			(r[t].batch = (void **)malloc((trace->max_batch + 1) * sizeof(void *))) == NULL)
+			unix_error("malloc failed in eval_threads");
+		if (handoff && (r[t].ring = (ring_t *)calloc(1, sizeof(ring_t))) == NULL)
+			unix_error("calloc failed in eval_threads");
+	}
+
+	for (run = 0; run < THREAD_RUNS; run++)
+	{
+		struct timespec start, end;
+		double secs;
+
+		if (!libc)
+		{
+			mem_reset_brk();
+			if (mm_init_threads(nthreads) < 0)
+				app_error("mm_init_threads failed in eval_threads");
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (t = 0; t < nthreads; t++)
+		{
+			if (pthread_create(&r[t].tid, NULL, replay_thread, &r[t]) != 0)
+				unix_error("pthread_create failed in eval_threads");
+			if (handoff && pthread_create(&r[t].partner, NULL, free_thread, &r[t]) != 0)
+				unix_error("pthread_create failed in eval_threads");
+		}
+		for (t = 0; t < nthreads; t++)
+		{
+			pthread_join(r[t].tid, NULL);
+			if (handoff)
+				pthread_join(r[t].partner, NULL);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		if (secs < best)
+			best = secs;
+	}
+
+	for (t = 0; t < nthreads; t++)
+	{
+		free(r[t].blocks);
+		free(r[t].batch);
+		free(r[t].ring);
+	}
+	free(r);
+	return best;
+}
+
+/*
+ * eval_scaling - run every trace at 1, 2, 4, ... up to max_threads
+ *    threads, as independent copies and with handoff, through mm_*
+ *    and optionally libc, and print the aggregate throughput of each.
+ *    Every thread needs as much heap as the trace did on one, so a
+ *    thread count whose copies won't fit in MAX_HEAP is skipped.
+ */
+static void eval_scaling(char *tracedir, char **tracefiles, int num_tracefiles,
+						 int max_threads, int run_libc)
+{
+	trace_t **traces;
+	double ops = 0;
+	int i, n, col;
+	int ncols = run_libc ? 4 : 2;
+	double base[4];
+	size_t *peaks;
+	static const char *names[4] = {"mm-copies", "mm-handoff", "libc-copies", "libc-handoff"};
+
+	if ((traces = (trace_t **)malloc(num_tracefiles * sizeof(trace_t *))) == NULL ||
+		(peaks = (size_t *)calloc(num_tracefiles, sizeof(size_t))) == NULL)
+		unix_error("malloc failed in eval_scaling");
+	for (i = 0; i < num_tracefiles; i++)
+	{
+		traces[i] = read_trace(tracedir, tracefiles[i]);
+		ops += traces[i]->num_ops;
+	}
+
+	printf("\nScaling (Kops over all threads, best of %d):\n%7s", THREAD_RUNS, "threads");
+	for (col = 0; col < ncols; col++)
+		printf("%14s%8s", names[col], "speedup");
+	printf("\n");
+
+	for (n = 1; n <= max_threads; n = (n * 2 > max_threads && n < max_threads) ? max_threads : n * 2)
+	{
+		int big = 0;
+
+		/* The 1 thread row, which always runs, measures the peaks */
+		for (i = 1; i < num_tracefiles; i++)
+			if (peaks[i] > peaks[big])
+				big = i;
+		if ((double)n * peaks[big] > MAX_HEAP)
+		{
+			printf("%7d  skipped: %d copies of %s need %.0f MB of heap, over MAX_HEAP (%d MB)\n",
+				   n, n, tracefiles[big], (double)n * peaks[big] / (1 << 20), MAX_HEAP >> 20);
+			continue;
+		}
+
+		printf("%7d", n);
+		for (col = 0; col < ncols; col++)
+		{
+			double secs = 0;
+			double kops;
+
+			for (i = 0; i < num_tracefiles; i++)
+			{
+				secs += eval_threads(traces[i], n, col % 2, col >= 2);
+				if (n == 1 && col < 2 && mem_heap_peak() > peaks[i])
+					peaks[i] = mem_heap_peak();
+			}
+			kops = (n * ops / 1e3) / secs;
+			if (n == 1)
+				base[col] = kops;
+			printf("%14.0f%7.2fx", kops, kops / base[col]);
+		}
+		printf("\n");
+	}
+
+	for (i = 0; i < num_tracefiles; i++)
+		free_trace(traces[i]);
+	free(traces);
+	free(peaks);
+}
+
+/*************************************
+ * Some miscellaneous helper routines
+ ************************************/
+
+/*
+ * printresults - prints a performance summary for some malloc package
+ */
+static void printresults(int n, stats_t *stats)
+{
+	int i;
+	double secs = 0;
 	double ops = 0;
 	double util = 0;
 
@@ -1045,6 +2313,144 @@ static void printresults(int n, stats_t *stats)
 	}
 }
 
+/*
+ * printrealloc - prints the mm_realloc counters for the traces that
+ *    call realloc at all
+ */
+static void printrealloc(int n, stats_t *stats)
+{
+	int i;
+	int header = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		mm_realloc_stats_t *r = &stats[i].realloc;
+		if (!stats[i].valid || r->in_place + r->remapped + r->moved == 0)
+			continue;
+		if (!header)
+		{
+			printf("\nRealloc:\n%5s%10s%8s%10s%8s%14s%14s\n",
+				   "trace", "in-place", "grown", "remapped", "moved", "bytes-copied", "bytes-avoided");
+			header = 1;
+		}
+		printf("%2d%13llu%8llu%10llu%8llu%14llu%14llu\n",
+			   i,
+			   (unsigned long long)r->in_place,
+			   (unsigned long long)r->grown,
+			   (unsigned long long)r->remapped,
+			   (unsigned long long)r->moved,
+			   (unsigned long long)r->bytes_copied,
+			   (unsigned long long)r->bytes_avoided);
+	}
+}
+
+/*
+ * printalloc - prints the mm_stats counters of each trace: the
+ *    searches, coalesces, splits and heap growth, then how many
+ *    allocations fell in each size class (by its smallest block)
+ */
+static void printalloc(int n, stats_t *stats)
+{
+	int i, cls, shown;
+
+	printf("\nAllocator:\n%5s%11s%8s%8s%8s%8s%8s%15s%15s%7s%12s\n",
+		   "trace", "probes/fit", "c-none", "c-next", "c-prev", "c-both", "splits",
+		   "requested(KB)", "handed-out(KB)", "grows", "grown(KB)");
+	for (i = 0; i < n; i++)
+	{
+		mm_stats_t *a = &stats[i].alloc;
+		if (!stats[i].valid)
+			continue;
+		printf("%2d%14.2f%8llu%8llu%8llu%8llu%8llu%15.0f%15.0f%7llu%12.0f\n",
+			   i,
+			   a->fits ? (double)a->fit_probes / a->fits : 0.0,
+			   (unsigned long long)a->coalesce[0],
+			   (unsigned long long)a->coalesce[1],
+			   (unsigned long long)a->coalesce[2],
+			   (unsigned long long)a->coalesce[3],
+			   (unsigned long long)a->splits,
+			   a->requested / 1024.0,
+			   a->handed_out / 1024.0,
+			   (unsigned long long)a->heap_grows,
+			   a->heap_grown / 1024.0);
+	}
+
+	printf("\nAllocations by size class (block bytes:count):\n");
+	for (i = 0; i < n; i++)
+	{
+		mm_stats_t *a = &stats[i].alloc;
+		if (!stats[i].valid)
+			continue;
+		printf("%2d", i);
+		for (cls = shown = 0; cls < MM_CLASSES; cls++)
+		{
+			if (a->mallocs[cls] == 0)
+				continue;
+			if (shown > 0 && shown % 8 == 0)
+				printf("\n  ");
+			printf(" %7u:%-7llu", mm_class_floor(cls), (unsigned long long)a->mallocs[cls]);
+			shown++;
+		}
+		printf("\n");
+	}
+}
+
+/*
+ * printmemory - prints heap size and resident bytes (in KB) from the
+ *    utilization run of each trace
+ */
+static void printmemory(int n, stats_t *stats)
+{
+	int i;
+
+	printf("\nMemory (KB):\n%5s%11s%11s%15s%13s%15s%14s%16s\n",
+		   "trace", "heap-peak", "heap-final", "footprint-peak", "mapped-final",
+		   "resident-peak", "resident-avg", "resident-final");
+	for (i = 0; i < n; i++)
+	{
+		if (!stats[i].valid)
+			continue;
+		printf("%2d%14.0f%11.0f%15.0f%13.0f%15.0f%14.0f%16.0f\n",
+			   i,
+			   stats[i].heap_peak / 1024,
+			   stats[i].heap_final / 1024,
+			   stats[i].footprint_peak / 1024,
+			   stats[i].mapped_final / 1024,
+			   stats[i].resident_peak / 1024,
+			   stats[i].resident_avg / 1024,
+			   stats[i].resident_final / 1024);
+	}
+}
+
+/*
+ * printlatency - prints the latency percentiles, in ns, of each
+ *    request type the traces use
+ */
+static void printlatency(int n, stats_t *stats, const char *name)
+{
+	static const char *opnames[REQUEST_TYPES] = {"malloc", "free", "realloc",
+												 "free-sized", "batch-alloc", "batch-free",
+												 "memalign", "calloc"};
+	int i, type;
+
+	printf("\nLatency (ns) for %s:\n%5s%9s%9s%8s%8s%8s%8s%9s\n",
+		   name, "trace", "op", "count", "p50", "p90", "p99", "p99.9", "max");
+	for (i = 0; i < n; i++)
+	{
+		if (!stats[i].valid)
+			continue;
+		for (type = 0; type < REQUEST_TYPES; type++)
+		{
+			latency_t *l = &stats[i].latency[type];
+			if (l->count == 0)
+				continue;
+			printf("%2d%12s%9.0f%8.0f%8.0f%8.0f%8.0f%9.0f\n",
+				   i, opnames[type], l->count,
+				   l->p50, l->p90, l->p99, l->p999, l->max);
+		}
+	}
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -1077,14 +2483,18 @@ void malloc_error(int tracenum, int opnum, const char *msg)
  */
 static void usage(void)
 {
-	fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+	fprintf(stderr, "Usage: mdriver [-hvValL] [-f <file>] [-t <dir>] [-T <n>] [-F <n>]\n");
 	fprintf(stderr, "Options\n");
 	fprintf(stderr, "\t-a         Don't check the team structure.\n");
 	fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+	fprintf(stderr, "\t-F <n>     Write each trace's heap fragmentation every <n> requests\n");
+	fprintf(stderr, "\t           to <trace>.frag.csv and <trace>.heat.pgm.\n");
 	fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
 	fprintf(stderr, "\t-h         Print this message.\n");
 	fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+	fprintf(stderr, "\t-L         Print latency percentiles for each request type.\n");
 	fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+	fprintf(stderr, "\t-T <n>     Also replay the traces on 1, 2, 4, ... <n> threads.\n");
 	fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
 	fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
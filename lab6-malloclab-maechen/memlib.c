@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE  /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,6 +11,8 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
@@ -18,20 +21,85 @@
 char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_peak_brk;   /* highest the brk has been since the last reset */
+static char *mem_zero_brk;   /* the heap reads as zeros from here up (>= mem_brk) */
+
+/*
+ * Direct mappings handed out by mem_mmap, kept so the driver can check
+ * payloads against them and so a reset can unmap whatever is left
+ */
+typedef struct {
+    char *addr;
+    size_t len;
+} mapping_t;
+
+static mapping_t *mem_maps;       /* live mappings, unordered */
+static int mem_nmaps;
+static int mem_maxmaps;
+static size_t mem_mapped;        /* bytes in live mappings */
+static size_t mem_peak_footprint; /* largest heap + mapped bytes since reset */
+
+/*
+ * mem_sbrk and the mapping calls can be used from several threads;
+ * this lock covers the brk, the mapping table and the counters
+ */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void update_peak(void)
+{
+    size_t footprint = (size_t)(mem_brk - mem_start_brk) + mem_mapped;
+    if (footprint > mem_peak_footprint)
+	mem_peak_footprint = footprint;
+}
+
+static char *page_up(void *p)
+{
+    uintptr_t page = mem_pagesize();
+    return (char *)(((uintptr_t)p + page - 1) & ~(page - 1));
+}
+
+/* mem_release without the bookkeeping, for callers holding mem_lock */
+static int release_pages(void *lo, size_t len)
+{
+    char *first = page_up(lo);
+    char *last = (char *)(((uintptr_t)lo + len) & ~(mem_pagesize() - 1));
+
+    if (last <= first)
+	return 0;
+    madvise(first, last - first, MADV_DONTNEED);
+    return 1;
+}
+
+static int find_mapping(char *addr)
+{
+    int i;
+
+    for (i = 0; i < mem_nmaps; i++)
+	if (mem_maps[i].addr == addr)
+	    return i;
+    return -1;
+}
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model. The heap is reserved
+ *    with mmap rather than malloc, since in libmm.so malloc is mm_malloc;
+ *    pages are only backed once the brk passes them, as with a real
+ *    sbrk, and the heap starts on a page boundary.
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* reserve the address space we will use to model the available VM */
+    mem_start_brk = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_peak_brk = mem_start_brk;
+    mem_zero_brk = mem_start_brk;
 }
 
 /* 
@@ -39,35 +107,284 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    munmap(mem_start_brk, MAX_HEAP);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and drop any mappings the last run left behind. What the last run
+ *    wrote is still there, until mem_release.
  */
 void mem_reset_brk()
 {
     mem_brk = mem_start_brk;
+    mem_peak_brk = mem_start_brk;
+    while (mem_nmaps > 0)
+	mem_munmap(mem_maps[0].addr, mem_maps[0].len);
+    mem_peak_footprint = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap and gives the pages above the new
+ *    brk back, as a real sbrk would.
  */
 void *mem_sbrk(int incr) 
 {
-    char *old_brk = mem_brk;
+    char *zero;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    return mem_sbrk_zero(incr, &zero);
+}
+
+/*
+ * mem_sbrk_zero - mem_sbrk that also sets *zero to where the new area
+ *    starts reading as zeros: a heap that was reset rather than released
+ *    still holds what was written below its old brk
+ */
+void *mem_sbrk_zero(int incr, char **zero)
+{
+    char *old_brk;
+
+    pthread_mutex_lock(&mem_lock);
+    old_brk = mem_brk;
+    if ( (mem_brk + incr) < mem_start_brk) {
+	pthread_mutex_unlock(&mem_lock);
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below the heap start...\n");
+	return (void *)-1;
+    }
+    if ( (mem_brk + incr) > mem_max_addr) {
+	pthread_mutex_unlock(&mem_lock);
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
     mem_brk += incr;
+    *zero = mem_zero_brk > old_brk ? mem_zero_brk : old_brk;
+    if (*zero > mem_brk)
+	*zero = mem_brk;
+    if (incr < 0) {
+	release_pages(mem_brk, -incr);
+	if (mem_zero_brk == old_brk)
+	    mem_zero_brk = page_up(mem_brk);
+    }
+    if (mem_brk > mem_zero_brk)
+	mem_zero_brk = mem_brk;
+    if (mem_brk > mem_peak_brk)
+	mem_peak_brk = mem_brk;
+    update_peak();
+    pthread_mutex_unlock(&mem_lock);
     return (void *)old_brk;
 }
 
+/*
+ * add_mapping - enter a new mapping in the table, or unmap it and
+ *    return (void *)-1 if the table can't grow
+ */
+static void *add_mapping(char *addr, size_t len)
+{
+    pthread_mutex_lock(&mem_lock);
+    if (mem_nmaps == mem_maxmaps) {
+	/* not realloc: this may be running inside mm_malloc */
+	int max = mem_maxmaps ? 2 * mem_maxmaps : 256;
+	mapping_t *maps = mem_maps
+	    ? mremap(mem_maps, mem_maxmaps * sizeof(mapping_t),
+		     max * sizeof(mapping_t), MREMAP_MAYMOVE)
+	    : mmap(NULL, max * sizeof(mapping_t), PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (maps == MAP_FAILED) {
+	    pthread_mutex_unlock(&mem_lock);
+	    munmap(addr, len);
+	    errno = ENOMEM;
+	    return (void *)-1;
+	}
+	mem_maps = maps;
+	mem_maxmaps = max;
+    }
+    mem_maps[mem_nmaps].addr = addr;
+    mem_maps[mem_nmaps].len = len;
+    mem_nmaps++;
+    mem_mapped += len;
+    update_peak();
+    pthread_mutex_unlock(&mem_lock);
+    return addr;
+}
+
+/*
+ * mem_mmap - a fresh, zeroed, page aligned mapping of len bytes
+ *    outside the heap, or (void *)-1
+ */
+void *mem_mmap(size_t len)
+{
+    char *addr;
+
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_mmap failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+    return add_mapping(addr, len);
+}
+
+/*
+ * mem_mmap_aligned - mem_mmap for a mapping whose address plus lead
+ *    is a multiple of align; both are multiples of the page size. Maps
+ *    align - page bytes more than needed and unmaps what is left over
+ *    at either end.
+ */
+void *mem_mmap_aligned(size_t len, size_t align, size_t lead)
+{
+    size_t extra = align - mem_pagesize();
+    char *addr, *start;
+
+    addr = mmap(NULL, len + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_mmap failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+    start = (char *)((((uintptr_t)addr + lead + align - 1) & ~(align - 1)) - lead);
+    if (start > addr)
+	munmap(addr, start - addr);
+    if (start < addr + extra)
+	munmap(start + len, addr + extra - start);
+    return add_mapping(start, len);
+}
+
+/*
+ * mem_munmap - unmap a whole mapping returned by mem_mmap/mem_mremap
+ */
+int mem_munmap(void *addr, size_t len)
+{
+    int i;
+
+    pthread_mutex_lock(&mem_lock);
+    i = find_mapping(addr);
+    if (i < 0 || mem_maps[i].len != len) {
+	pthread_mutex_unlock(&mem_lock);
+	errno = EINVAL;
+	return -1;
+    }
+    mem_mapped -= len;
+    mem_maps[i] = mem_maps[--mem_nmaps];
+    pthread_mutex_unlock(&mem_lock);
+    munmap(addr, len);
+    return 0;
+}
+
+/*
+ * mem_mremap - resize a mapping, moving it if it has to; the pages
+ *    move with it rather than being copied. Returns (void *)-1 on
+ *    failure, leaving the old mapping alone.
+ */
+void *mem_mremap(void *addr, size_t oldlen, size_t newlen)
+{
+    int i;
+    char *newaddr;
+
+    pthread_mutex_lock(&mem_lock);
+    i = find_mapping(addr);
+    if (i < 0 || mem_maps[i].len != oldlen) {
+	pthread_mutex_unlock(&mem_lock);
+	errno = EINVAL;
+	return (void *)-1;
+    }
+    newaddr = mremap(addr, oldlen, newlen, MREMAP_MAYMOVE);
+    if (newaddr != MAP_FAILED) {
+	mem_maps[i].addr = newaddr;
+	mem_maps[i].len = newlen;
+	mem_mapped = mem_mapped - oldlen + newlen;
+	update_peak();
+    }
+    pthread_mutex_unlock(&mem_lock);
+    return newaddr == MAP_FAILED ? (void *)-1 : newaddr;
+}
+
+/*
+ * mem_is_mapped - is [lo, hi] inside a single live mapping?
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    int i;
+
+    for (i = 0; i < mem_nmaps; i++)
+	if ((char *)lo >= mem_maps[i].addr &&
+	    (char *)hi < mem_maps[i].addr + mem_maps[i].len)
+	    return 1;
+    return 0;
+}
+
+/*
+ * mem_mapped_bytes - bytes in live mappings
+ */
+size_t mem_mapped_bytes()
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_release - tell the system the whole pages inside [lo, lo + len)
+ *    are no longer needed. They stay mapped and read back as zeros.
+ */
+void mem_release(void *lo, size_t len)
+{
+    char *first, *last;
+
+    if (!release_pages(lo, len))
+	return;
+    first = page_up(lo);
+    last = (char *)(((uintptr_t)lo + len) & ~(mem_pagesize() - 1));
+
+    /* A release reaching past the brk zeroes the heap from first up */
+    if (last >= __atomic_load_n(&mem_zero_brk, __ATOMIC_RELAXED)) {
+	pthread_mutex_lock(&mem_lock);
+	if (first < mem_zero_brk && last >= mem_zero_brk)
+	    mem_zero_brk = first > mem_brk ? first : mem_brk;
+	pthread_mutex_unlock(&mem_lock);
+    }
+}
+
+/*
+ * resident_bytes - bytes of [lo, lo + len) backed by memory right now
+ */
+static size_t resident_bytes(char *lo, size_t len)
+{
+    static unsigned char *vec;
+    static size_t veclen;
+    uintptr_t page = mem_pagesize();
+    uintptr_t first = (uintptr_t)lo & ~(page - 1);
+    size_t pages = ((uintptr_t)lo + len - first + page - 1) / page;
+    size_t i, resident = 0;
+
+    if (pages > veclen) {
+	free(vec);
+	if ((vec = malloc(pages)) == NULL) {
+	    veclen = 0;
+	    return 0;
+	}
+	veclen = pages;
+    }
+    if (mincore((void *)first, pages * page, vec) < 0)
+	return 0;
+    for (i = 0; i < pages; i++)
+	resident += vec[i] & 1;
+    return resident * page;
+}
+
+/*
+ * mem_resident - bytes of [mem_heap_lo(), mem_heap_lo() + len) and of
+ *    the live mappings that are actually backed by memory right now
+ */
+size_t mem_resident(size_t len)
+{
+    size_t resident = resident_bytes(mem_start_brk, len);
+    int i;
+
+    for (i = 0; i < mem_nmaps; i++)
+	resident += resident_bytes(mem_maps[i].addr, mem_maps[i].len);
+    return resident;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -92,6 +409,24 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_heap_peak() - returns the largest the heap has been, in bytes,
+ *    since the last mem_reset_brk
+ */
+size_t mem_heap_peak() 
+{
+    return (size_t)(mem_peak_brk - mem_start_brk);
+}
+
+/*
+ * mem_footprint_peak() - returns the largest the heap and the mappings
+ *    together have been, in bytes, since the last mem_reset_brk
+ */
+size_t mem_footprint_peak() 
+{
+    return mem_peak_footprint;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -3,9 +3,21 @@
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+void *mem_sbrk_zero(int incr, char **zero);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_heap_peak(void);
+size_t mem_footprint_peak(void);
 size_t mem_pagesize(void);
+void mem_release(void *lo, size_t len);
+size_t mem_resident(size_t len);
+
+void *mem_mmap(size_t len);
+void *mem_mmap_aligned(size_t len, size_t align, size_t lead);
+int mem_munmap(void *addr, size_t len);
+void *mem_mremap(void *addr, size_t oldlen, size_t newlen);
+int mem_is_mapped(void *lo, void *hi);
+size_t mem_mapped_bytes(void);
 
@@ -2,15 +2,18 @@
  * mm-implicit.c -  Simple allocator based on implicit free lists, 
  *                  first fit placement, and boundary tag coalescing. 
  *
- * Each block has header and footer of the form:
+ * Each block has a header of the form:
  * 
  *      31                     3  2  1  0 
  *      -----------------------------------
- *     | s  s  s  s  ... s  s  s  0  0  a/f
+ *     | s  s  s  s  ... s  s  s  0 pa a/f
  *      ----------------------------------- 
  * 
- * where s are the meaningful size bits and a/f is set 
- * iff the block is allocated. The list has the following form:
+ * where s are the meaningful size bits, a/f is set iff the block
+ * is allocated and pa is set iff the previous block is allocated.
+ * Only free blocks carry a footer (a copy of the size), since
+ * coalesce only ever looks back at a neighbour it knows is free.
+ * The list has the following form:
  *
  * begin                                                          end
  * heap                                                           heap  
@@ -21,14 +24,18 @@
  *          |         block       |                       | block    |
  *
  * The allocated prologue and epilogue blocks are overhead that
- * eliminate edge conditions during coalescing.
+ * eliminate edge conditions during coalescing. With several arenas
+ * (mm_init_threads) the heap is a series of such pieces, each with its
+ * own pad, prologue and epilogue.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <memory.h>
+#include <pthread.h>
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
 #include <math.h>
 
 /*********************************************************
@@ -59,39 +66,344 @@ team_t team = {
 #define WSIZE       4       /* word size (bytes) */  
 #define DSIZE       8       /* doubleword size (bytes) */
 #define CHUNKSIZE  (1<<12)  /* initial heap size (bytes) */
-#define OVERHEAD    8       /* overhead of header and footer (bytes) */
-#define LISTSIZE 32
+#define OVERHEAD    4       /* overhead of an allocated block's header (bytes) */
+//
+// Payloads are ALIGNMENT aligned, 8 bytes for mdriver and 16 (x86-64's
+// max_align_t) in libmm. Block sizes are multiples of it, and since the
+// first block's payload is 4 words into the heap (or a piece) that is
+// enough to keep every payload aligned.
+//
+#define ALIGN       ALIGNMENT
+_Static_assert(ALIGN == 8 || ALIGN == 16, "payloads are 8 or 16 byte aligned");
 
-static int custom_log(uint32_t memorySize) {
-    int result = -1;
-    while (memorySize > 0) {
-        memorySize >>= 1;
-        result++;
-    }
-    return result;
-}
+//
+// Giving memory back. A free block that has sat at the top of the heap
+// for TRIM_DECAY calls, at least the trim threshold big, is cut down to
+// TRIM_KEEP bytes and the rest goes back through a negative mem_sbrk.
+// The trim threshold starts at TRIM_THRESHOLD and, like glibc's, moves
+// up to twice the largest block trimmed so far. Between the two, a
+// program that frees and regrows the top of the heap in bursts doesn't
+// pay for the page faults on every burst.
+//
+// A free that leaves a free block of RELEASE_THRESHOLD or more below
+// the top releases the pages of the block it just freed; the free
+// block's links and footer stay put.
+//
+#define TRIM_THRESHOLD    (256 * 1024)
+#define TRIM_KEEP         (64 * 1024)
+#define TRIM_DECAY        8192
+#define RELEASE_THRESHOLD (1024 * 1024)
+
+//
+// Size classes are TLSF style: the first level is the octave,
+// floor(log2(size)), and the second level splits each octave into
+// SL_COUNT equal slices using the next SL_BITS bits below the top one.
+// Both come from a single count-leading-zeros. memorySize is never
+// below 2 * DSIZE here, so there are always SL_BITS bits to take.
+//
+#define SL_BITS     3
+#define SL_COUNT    (1 << SL_BITS)
+#define FL_COUNT    32
+#define LISTSIZE    (FL_COUNT * SL_COUNT)
+_Static_assert(LISTSIZE == MM_CLASSES, "mm.h's MM_CLASSES is the number of free lists");
+
+//
+// find_fit looks at no more than this many blocks of a list when it
+// searches for the best fit
+//
+#define FIT_PROBES  8
 
-static int sizeToIndex(uint32_t memorySize) { return custom_log(memorySize); }
+static inline int sizeToIndex(uint32_t memorySize) {
+  int fl = 31 - __builtin_clz(memorySize);
+  int sl = (memorySize >> (fl - SL_BITS)) & (SL_COUNT - 1);
+  return fl * SL_COUNT + sl;
+}
 
+//
+// Free list links are 32-bit offsets from the start of the heap
+// (heap_base) rather than pointers; the heap is never larger than
+// MAX_HEAP so they always fit. Offset 0 is the alignment pad in front
+// of the prologue, never a block, so it doubles as the null link.
+//
 struct explicit_free_list
 {
-  struct explicit_free_list *next;
-  struct explicit_free_list *prev;
+  uint32_t next;
+  uint32_t prev;
+};
+
+static char *heap_base;
+
+static inline struct explicit_free_list *NODE(uint32_t offset) {
+  return (struct explicit_free_list *)(heap_base + offset);
+}
+
+static inline uint32_t OFFSET(void *bp) {
+  return (uint32_t)((char *)bp - heap_base);
+}
+
+//
+// A free block needs room for its header, the list links and its
+// footer; allocated blocks are never smaller so any block can be freed
+//
+#define MIN_BLOCK   (ALIGN * ((WSIZE + sizeof(struct explicit_free_list) + WSIZE + ALIGN - 1) / ALIGN))
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Slab tier
+//
+// Requests of at most SLAB_MAX bytes are served from runs: SLAB_RUN
+// byte, SLAB_RUN aligned (relative to heap_base) pieces of the heap cut
+// into equal slots of one size class. The objects have no header; a
+// side bitmap of the heap's SLAB_RUN sized pages says which pages are
+// runs, and the run header at the start of the page holds the class
+// and a free-slot bitmap. To the rest of the allocator a run is just
+// one allocated block, so slab frees never coalesce and an empty run is
+// handed back with an ordinary mm_free. The block is sized so the next
+// header takes the last word of the page, which lets runs carved one
+// after the other tile the heap with no gaps.
+//
+#define SLAB_RUN      4096
+#define SLAB_BYTES    (SLAB_RUN - OVERHEAD)  /* the run's block is exactly one page */
+#define SLAB_MAX      64
+#define SLAB_CLASSES  (SLAB_MAX / ALIGN)
+#define SLAB_MAP_WORDS ((SLAB_BYTES / ALIGN + 63) / 64)
+#define SLAB_PAGES    (MAX_HEAP / SLAB_RUN)
+
+struct slab_run
+{
+  uint32_t next;        /* offsets of the other partly used runs of this class */
+  uint32_t prev;
+  uint16_t cls;
+  uint16_t slotSize;
+  uint16_t nslots;
+  uint16_t nfree;
+  uint64_t freeMap[SLAB_MAP_WORDS];  /* bit set iff that slot is free */
+};
+
+//
+// slabPages is shared by all the arenas, so its words are only changed
+// with atomic ors and ands
+//
+static uint32_t slabPages[SLAB_PAGES / 32];
+
+static inline struct slab_run *RUN(uint32_t offset) {
+  return (struct slab_run *)(heap_base + offset);
+}
+
+static inline int IS_SLAB(void *bp) {
+  uint32_t page = OFFSET(bp) / SLAB_RUN;
+  return (__atomic_load_n(&slabPages[page / 32], __ATOMIC_RELAXED) >> (page % 32)) & 0x1;
+}
+
+_Static_assert(sizeof(struct slab_run) % ALIGN == 0, "the first slot is aligned");
+
+static inline char *SLOTS(struct slab_run *run) {
+  return (char *)run + sizeof(struct slab_run);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Huge requests skip the heap. Anything over MMAP_THRESHOLD bytes gets a
+// page aligned mapping of its own from mem_mmap, with the payload
+// MMAP_OVERHEAD bytes in and the header in the word before it, and goes
+// straight back with mem_munmap when freed. The header's size is the
+// length of the mapping. A pointer outside the simulated heap is always
+// one of these.
+//
+// A huge mm_memalign starts its payload further in, align bytes or a
+// page if align is bigger, so the mapping always starts on the page
+// holding the word MMAP_OVERHEAD bytes before the payload.
+//
+#define MMAP_THRESHOLD (128 * 1024)
+#define MMAP_OVERHEAD  ALIGN
+
+static inline int IS_MAPPED(void *bp) {
+  return (uintptr_t)((char *)bp - heap_base) >= MAX_HEAP;
+}
+
+static inline char *MAPPING_START(void *bp) {
+  return (char *)(((uintptr_t)bp - MMAP_OVERHEAD) & ~((uintptr_t)mem_pagesize() - 1));
+}
+
+//
+// MAPPING_SIZE - length of a mapping for a size byte payload lead
+// bytes into it
+//
+static inline uint32_t MAPPING_SIZE(uint32_t lead, uint32_t size) {
+  uint32_t page = mem_pagesize();
+  return (size + lead + page - 1) & ~(page - 1);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Arenas
+//
+// The free lists, their bitmaps and the partly used slab runs make up
+// an arena. mm_init sets up a single arena over the whole heap and
+// never locks it. mm_init_threads(n) sets up n arenas for use from
+// several threads instead: each has its own lock, and a thread is
+// given one, round robin, the first time it calls in.
+//
+// There an arena takes memory from the shared heap in whole
+// ARENA_GRANULEs. A reservation that doesn't follow on from the
+// arena's last one starts a new piece of heap with its own pad,
+// prologue and epilogue, so blocks never coalesce across arenas, and
+// arenaOf[] records which arena owns each granule, which is how a free
+// finds the arena to go back to. Only the single arena trims the heap.
+//
+#define MAX_ARENAS    16
+#define ARENA_GRANULE (256 * 1024)
+#define GRANULES      (MAX_HEAP / ARENA_GRANULE)
+
+struct arena
+{
+  pthread_mutex_t lock;
+  //
+  // start[i] is the offset of the first free block in size class i.
+  // Bit sl of slBitmap[fl] is set iff start[fl * SL_COUNT + sl] holds
+  // a free block, and bit fl of flBitmap is set iff slBitmap[fl] is
+  // non-zero, so find_fit jumps to the first usable list with two
+  // find-first-sets.
+  //
+  uint32_t start[LISTSIZE];
+  uint32_t flBitmap;
+  uint32_t slBitmap[FL_COUNT];
+  //
+  // slabPartial[c] is the offset of the first run of class c with a
+  // free slot, 0 if there is none
+  //
+  uint32_t slabPartial[SLAB_CLASSES];
+  char *end;                /* bp of the epilogue of the piece we grow */
+  char *limit;              /* end of that piece's reservation */
+  char *fresh;              /* zeros from here to the top block's footer */
+  uint32_t trimThreshold;
+  uint32_t opCount;         /* mm_malloc and mm_free calls since mm_init */
+  uint32_t topIdleSince;    /* opCount when the top became trimmable, 0 if not */
+};
+
+static struct arena arenas[MAX_ARENAS];
+static int narenas;
+static int threaded;              /* set up by mm_init_threads */
+static unsigned generation;       /* bumped by every init, so threads notice a new heap */
+static unsigned nextArena;
+static unsigned char arenaOf[GRANULES];
+static char *pieces[GRANULES];    /* first block of each piece of heap */
+static int npieces;
+
+static inline void lock_arena(struct arena *A) {
+  if (threaded) {
+    pthread_mutex_lock(&A->lock);
+  }
+}
+
+static inline void unlock_arena(struct arena *A) {
+  if (threaded) {
+    pthread_mutex_unlock(&A->lock);
+  }
+}
+
+static inline struct arena *block_arena(void *bp) {
+  return threaded ? &arenas[arenaOf[OFFSET(bp) / ARENA_GRANULE]] : &arenas[0];
+}
+
+//
+// Each thread keeps a few of the slab objects it frees, per class, and
+// hands them straight back to its next allocations of that class; a
+// malloc or free the cache can serve takes no lock at all. Cached
+// objects are still allocated as far as their runs are concerned. A
+// class holds at most TCACHE_COUNT objects and whatever is left when
+// the thread exits goes back to the runs. Only used after
+// mm_init_threads.
+//
+#define TCACHE_COUNT 32
+
+struct tcache
+{
+  unsigned generation;      /* the heap the rest belongs to */
+  struct arena *arena;      /* this thread's arena */
+  void *head[SLAB_CLASSES]; /* linked through the objects' first word */
+  uint16_t count[SLAB_CLASSES];
+};
+
+static __thread struct tcache tcache;
+static pthread_key_t tcacheKey;
+static pthread_once_t tcacheOnce = PTHREAD_ONCE_INIT;
+
+//
+// The counters behind mm_stats. Each thread counts into its own
+// thread_stats, with plain increments; the first count registers it on
+// allStats, and when it exits what it counted is folded into
+// exitedStats. Every init zeroes them all.
+//
+struct thread_stats
+{
+  mm_stats_t s;
+  struct thread_stats *next;
+  int registered;
 };
 
-struct explicit_free_list start[LISTSIZE];
+static __thread struct thread_stats threadStats;
+static struct thread_stats *allStats;
+static mm_stats_t exitedStats;
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t statsKey;
+static pthread_once_t statsOnce = PTHREAD_ONCE_INIT;
+
+static mm_stats_t *register_stats(void);
+
+static inline mm_stats_t *my_stats(void)
+{
+  return threadStats.registered ? &threadStats.s : register_stats();
+}
+
+static inline void *tcache_get(int cls)
+{
+  void *bp = tcache.head[cls];
+  if (bp) {
+    tcache.head[cls] = *(void **)bp;
+    tcache.count[cls]--;
+  }
+  return bp;
+}
+
+static inline int tcache_put(void *bp, int cls)
+{
+  if (tcache.count[cls] >= TCACHE_COUNT) {
+    return 0;
+  }
+  *(void **)bp = tcache.head[cls];
+  tcache.head[cls] = bp;
+  tcache.count[cls]++;
+  return 1;
+}
+
+static void *slab_malloc(struct arena *A, uint32_t size);
+static void slab_free(struct arena *A, void *bp);
+static void *alloc_aligned(struct arena *A, uint32_t asize, uint32_t align);
 
 static inline int MAX(int x, int y) {
   return x > y ? x : y;
 }
 
+static inline uint32_t MIN(uint32_t x, uint32_t y) {
+  return x < y ? x : y;
+}
+
+static inline void *MAX_PTR(void *x, void *y) {
+  return (char *)x > (char *)y ? x : y;
+}
+
+static inline void *MIN_PTR(void *x, void *y) {
+  return (char *)x < (char *)y ? x : y;
+}
+
 //
-// Pack a size and allocated bit into a word
-// We mask of the "alloc" field to insure only
-// the lower bit is used
+// Pack a size, previous-allocated bit and allocated bit into a word
+// We mask of the "alloc" fields to insure only
+// the lower two bits are used
 //
-static inline uint32_t PACK(uint32_t size, int alloc) {
-  return ((size) | (alloc & 0x1));
+static inline uint32_t PACK(uint32_t size, int prevAlloc, int alloc) {
+  return ((size) | ((prevAlloc & 0x1) << 1) | (alloc & 0x1));
 }
 
 //
@@ -114,8 +426,24 @@ static inline int GET_ALLOC( void *p  ) {
   return GET(p) & 0x1;
 }
 
+static inline int GET_PREV_ALLOC( void *p  ) {
+  return (GET(p) >> 1) & 0x1;
+}
+
+//
+// Set or clear the previous-allocated bit in the header at p
+//
+static inline void SET_PREV_ALLOC( void *p ) {
+  PUT(p, GET(p) | 0x2);
+}
+
+static inline void CLEAR_PREV_ALLOC( void *p ) {
+  PUT(p, GET(p) & ~0x2);
+}
+
 //
 // Given block ptr bp, compute address of its header and footer
+// (the footer only exists while the block is free)
 //
 static inline void *HDRP(void *bp) {
 
@@ -125,8 +453,16 @@ static inline void *FTRP(void *bp) {
   return ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE);
 }
 
+//
+// Payload bytes in a huge block
+//
+static inline uint32_t MAPPED_PAYLOAD(void *bp) {
+  return GET_SIZE(HDRP(bp)) - ((char *)bp - MAPPING_START(bp));
+}
+
 //
 // Given block ptr bp, compute address of next and previous blocks
+// (the previous block can only be found when it is free)
 //
 static inline void *NEXT_BLKP(void *bp) {
   return  ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)));
@@ -141,39 +477,123 @@ static inline void* PREV_BLKP(void *bp){
 // Global Variables
 //
 
-static char *heap_listp;  /* pointer to first block */ 
+static mm_realloc_stats_t reallocStats;  /* updated atomically */
 
 //
 // function prototypes for internal helper routines
 //
-static void *extend_heap(uint32_t words);
-static void place(void *bp, uint32_t asize);
-static void *find_fit(uint32_t asize);
-static void *coalesce(void *bp);
+static int init_arenas(int n, int threads);
+static struct arena *thread_arena(void);
+static void tcache_flush(void *unused);
+static void *arena_sbrk(struct arena *A, uint32_t incr);
+static void *extend_heap(struct arena *A, uint32_t words);
+static void *free_top(struct arena *A, char *bp, uint32_t size);
+static void *arena_malloc(struct arena *A, uint32_t size, char **fresh);
+static void arena_free(struct arena *A, void *bp);
+static char *place(struct arena *A, void *bp, uint32_t asize);
+static void *find_fit(struct arena *A, uint32_t asize);
+static void *best_fit(struct arena *A, int i, uint32_t asize);
+static void *coalesce(struct arena *A, void *bp);
+static uint32_t adjust_block_size(uint32_t size);
+static int grow_block(struct arena *A, void *bp, uint32_t size);
+static void *mapped_malloc(uint32_t size);
+static void *mapped_memalign(uint32_t align, uint32_t size);
+static void *mapped_resize(void *bp, uint32_t size);
+static void trim_top(struct arena *A);
+static void add_node(struct arena *A, struct explicit_free_list *node, uint32_t memorySize);
+static void delete_node(struct arena *A, struct explicit_free_list *p);
+static void checkpiece(char *heap_listp, int verbose);
 static void printblock(void *bp); 
-static void checkblock(void *bp);
+static void checkblock(void *bp, int prev_alloc);
+static void checkrun(void *bp);
+
+static inline void count(uint64_t *counter, uint64_t n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+//
+// count_malloc - count an allocation of size bytes that got a block
+// with room for payload bytes
+//
+static inline void count_malloc(uint32_t size, uint32_t payload) {
+  mm_stats_t *st = my_stats();
+  st->mallocs[sizeToIndex(size <= MMAP_THRESHOLD ? adjust_block_size(size) : size)]++;
+  st->requested += size;
+  st->handed_out += payload;
+}
  
 
 //
-// mm_init - Initialize the memory manager 
+// mm_init - Initialize the memory manager
+//
+int mm_init(void)
+{
+  return init_arenas(1, 0);
+}
+
+//
+// mm_init_threads - Initialize the memory manager for use from several
+// threads, with up to MAX_ARENAS arenas
 //
-int mm_init(void) 
+int mm_init_threads(int n)
+{
+  return init_arenas(n < 1 ? 1 : (n > MAX_ARENAS ? MAX_ARENAS : n), 1);
+}
+
+static void make_tcache_key(void)
+{
+  pthread_key_create(&tcacheKey, tcache_flush);
+}
+
+static int init_arenas(int n, int threads)
 {
-  for (int i = 0; i < LISTSIZE; i++){
-    start[i].next = start[i].prev = &start[i];
+  heap_base = mem_heap_lo();
+  for (int i = 0; i < n; i++) {
+    struct arena *A = &arenas[i];
+    memset(A, 0, sizeof(*A));
+    pthread_mutex_init(&A->lock, NULL);
+    A->trimThreshold = TRIM_THRESHOLD;
+    A->opCount = 1;
+  }
+  narenas = n;
+  threaded = threads;
+  generation++;
+  nextArena = 0;
+  npieces = 0;
+  memset(arenaOf, 0, sizeof(arenaOf));
+  memset(slabPages, 0, sizeof(slabPages));
+  memset(&reallocStats, 0, sizeof(reallocStats));
+  pthread_mutex_lock(&statsLock);
+  memset(&exitedStats, 0, sizeof(exitedStats));
+  for (struct thread_stats *T = allStats; T != NULL; T = T->next) {
+    memset(&T->s, 0, sizeof(T->s));
+  }
+  pthread_mutex_unlock(&statsLock);
+
+  //
+  // Arenas reserve their first piece the first time they grow
+  //
+  if (threaded) {
+    pthread_once(&tcacheOnce, make_tcache_key);
+    return 0;
   }
 
-  if ((heap_listp = mem_sbrk(4*WSIZE)) == (void *)-1){
+  char *heap_listp;
+  char *zero;
+  if ((heap_listp = mem_sbrk_zero(4*WSIZE, &zero)) == (void *)-1){
     return -1;
   }
-    
+
   PUT(heap_listp, 0);
-  PUT(heap_listp + (1 * WSIZE), PACK(DSIZE, 1));
-  PUT(heap_listp + (2 * WSIZE), PACK(DSIZE, 1));
-  PUT(heap_listp + (3 * WSIZE), PACK(0, 1));    
+  PUT(heap_listp + (1 * WSIZE), PACK(DSIZE, 1, 1));
+  PUT(heap_listp + (2 * WSIZE), PACK(DSIZE, 1, 1));
+  PUT(heap_listp + (3 * WSIZE), PACK(0, 1, 1));
   heap_listp += (2 * WSIZE);
+  pieces[npieces++] = heap_listp;
+  arenas[0].end = heap_listp + (2 * WSIZE);
+  arenas[0].fresh = MAX_PTR(zero, arenas[0].end + sizeof(struct explicit_free_list));
 
-  if (extend_heap(CHUNKSIZE / WSIZE) == NULL){
+  if (extend_heap(&arenas[0], CHUNKSIZE / WSIZE) == NULL){
     return -1;
   }
 
@@ -181,33 +601,156 @@ int mm_init(void)
 
 }
 
+//
+// thread_arena - the calling thread's arena. A thread that hasn't
+// called in since the last init (or ever) is given the next arena and
+// an empty cache.
+//
+static struct arena *thread_arena(void)
+{
+  if (!threaded) {
+    return &arenas[0];
+  }
+  if (tcache.generation != generation) {
+    memset(&tcache, 0, sizeof(tcache));
+    tcache.generation = generation;
+    tcache.arena = &arenas[__atomic_fetch_add(&nextArena, 1, __ATOMIC_RELAXED) % narenas];
+    pthread_setspecific(tcacheKey, &tcache);
+  }
+  return tcache.arena;
+}
+
+//
+// tcache_flush - give an exiting thread's cached objects back to
+// their runs
+//
+static void tcache_flush(void *unused)
+{
+  void *bp;
+
+  if (tcache.generation != generation) {
+    return;
+  }
+  for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+    while ((bp = tcache_get(cls)) != NULL) {
+      struct arena *A = block_arena(bp);
+      lock_arena(A);
+      slab_free(A, bp);
+      unlock_arena(A);
+    }
+  }
+}
+
+//
+// arena_sbrk - mem_sbrk for one arena: incr more bytes after A's
+// epilogue, whose header is the word before the address returned.
+// With several arenas a reservation that isn't contiguous with the
+// last one starts a new piece, and the unused end of the old piece
+// becomes a free block. Memory that memlib can't promise reads as
+// zeros moves A->fresh up past it.
+//
+static void *arena_sbrk(struct arena *A, uint32_t incr)
+{
+  char *bp;
+  char *zero;
+
+  if (!threaded) {
+    if ((bp = mem_sbrk_zero(incr, &zero)) != (void *)-1) {
+      A->end = bp + incr;
+      if (zero > bp) {
+        A->fresh = MAX_PTR(A->fresh, zero);
+      }
+    }
+    return bp;
+  }
+
+  if ((uint32_t)(A->limit - A->end) < incr) {
+    uint32_t len = (incr + 4*WSIZE + ARENA_GRANULE - 1) & ~(ARENA_GRANULE - 1);
+    char *piece = mem_sbrk_zero(len, &zero);
+
+    if (piece == (void *)-1) {
+      return piece;
+    }
+    memset(arenaOf + OFFSET(piece) / ARENA_GRANULE, A - arenas, len / ARENA_GRANULE);
+
+    if (piece == A->limit) {
+      A->limit += len;
+      if (zero > piece) {
+        A->fresh = MAX_PTR(A->fresh, zero);
+      }
+    }
+    else {
+      if ((uint32_t)(A->limit - A->end) >= MIN_BLOCK) {
+        bp = A->end;
+        A->end = A->limit;
+        free_top(A, bp, A->end - bp);
+      }
+      PUT(piece, 0);
+      PUT(piece + (1 * WSIZE), PACK(DSIZE, 1, 1));
+      PUT(piece + (2 * WSIZE), PACK(DSIZE, 1, 1));
+      PUT(piece + (3 * WSIZE), PACK(0, 1, 1));
+      pieces[__atomic_fetch_add(&npieces, 1, __ATOMIC_RELAXED)] = piece + (2 * WSIZE);
+      A->end = piece + (4 * WSIZE);
+      A->limit = piece + len;
+      A->fresh = MAX_PTR(zero, A->end + sizeof(struct explicit_free_list));
+    }
+  }
+
+  bp = A->end;
+  A->end += incr;
+  return bp;
+}
 
 //
 // extend_heap - Extend heap with free block and return its block pointer
 //
-static void *extend_heap(uint32_t words) 
+static void *extend_heap(struct arena *A, uint32_t words)
 {
   //
   // You need to provide this
   //
-    
+
     char *bp;
     size_t size;
-    
-    size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
-    
-    if ((long)(bp = mem_sbrk(size)) == -1) {
+
+    size = ALIGN * ((words * WSIZE + ALIGN - 1) / ALIGN);
+
+    if ((long)(bp = arena_sbrk(A, size)) == -1) {
         return NULL;
     }
+    my_stats()->heap_grows++;
+    my_stats()->heap_grown += size;
+    A->topIdleSince = 0;
+    return free_top(A, bp, size);
+}
+
+//
+// free_top - turn the size bytes at bp, just added to the top of a
+// piece, into a free block and a new epilogue
+//
+static void *free_top(struct arena *A, char *bp, uint32_t size)
+{
+    //
+    // The new block starts on the old epilogue header, which knows
+    // whether the last block is allocated
+    //
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp)), 0));
+    PUT(FTRP(bp), PACK(size, 0, 0));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 0, 1));
+
+    struct explicit_free_list *p2 = ((struct explicit_free_list *)coalesce(A, bp));
+
+    //
+    // Merged into the free block below: the old footer and epilogue
+    // are now in the middle of it, and may be in the zeroed part
+    //
+    if ((char *)p2 != bp && bp - DSIZE >= A->fresh) {
+        PUT(bp - DSIZE, 0);
+        PUT(bp - WSIZE, 0);
+    }
+
+    add_node(A, p2, GET_SIZE(HDRP(p2)));
 
-    PUT(HDRP(bp), PACK(size, 0));
-    PUT(FTRP(bp), PACK(size, 0));
-    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
-    
-    struct explicit_free_list *p2 = ((struct explicit_free_list *)coalesce(bp));
-    
-    add_node(p2, size);
-    
     return (void *)p2;
 }
 
@@ -217,20 +760,66 @@ static void *extend_heap(uint32_t words)
 //
 // find_fit - Find a fit for a block with asize bytes 
 //
-static void *find_fit(uint32_t asize)
+static void *find_fit(struct arena *A, uint32_t asize)
 {
-  // return NULL; /* no fit */
     struct explicit_free_list *bp;
-    
-    for (int i = sizeToIndex(asize); i < LISTSIZE; i++){
-      for (bp = start[i].next; bp != &start[i]; bp = bp->next){
-        if (asize <= GET_SIZE(HDRP(bp))){
-          return bp;
-        }
+    int i = sizeToIndex(asize);
+    int fl = i / SL_COUNT;
+    int sl = i % SL_COUNT;
+
+    my_stats()->fits++;
+
+    //
+    // Blocks in asize's own class may still be too small, so that list
+    // gets a bounded best-fit search...
+    //
+    if ((bp = best_fit(A, i, asize)) != NULL) {
+      return bp;
+    }
+
+    //
+    // ...but every block in a higher class is larger than anything in
+    // this one, so the first non-empty higher list is a fit; within it
+    // we still prefer the smallest of the first few blocks.
+    //
+    uint32_t slMap = (sl + 1 < SL_COUNT) ? A->slBitmap[fl] & (~0u << (sl + 1)) : 0;
+    if (!slMap) {
+      uint32_t flMap = (fl + 1 < FL_COUNT) ? A->flBitmap & (~0u << (fl + 1)) : 0;
+      if (!flMap) {
+        return NULL; /* no fit */
       }
+      fl = __builtin_ctz(flMap);
+      slMap = A->slBitmap[fl];
     }
-    
-    return NULL; /* no fit */
+    return best_fit(A, fl * SL_COUNT + __builtin_ctz(slMap), asize);
+}
+
+//
+// best_fit - smallest block of at least asize among the first
+// FIT_PROBES blocks of list i; stops early on an exact fit
+//
+static void *best_fit(struct arena *A, int i, uint32_t asize)
+{
+    struct explicit_free_list *bp;
+    struct explicit_free_list *best = NULL;
+    uint32_t bestSize = 0;
+    uint32_t offset;
+    int probes = 0;
+
+    for (offset = A->start[i]; offset && probes < FIT_PROBES; offset = bp->next, probes++) {
+      bp = NODE(offset);
+      uint32_t size = GET_SIZE(HDRP(bp));
+      if (size == asize) {
+        my_stats()->fit_probes += probes + 1;
+        return bp;
+      }
+      if (size > asize && (best == NULL || size < bestSize)) {
+        best = bp;
+        bestSize = size;
+      }
+    }
+    my_stats()->fit_probes += probes;
+    return best;
 }
 
 // 
@@ -241,93 +830,496 @@ void mm_free(void *bp)
   //
   // You need to provide this
   //
-    
-    size_t size = GET_SIZE(HDRP(bp));
-    PUT(HDRP(bp), PACK(size, 0));
-    PUT(FTRP(bp), PACK(size, 0));
-    struct explicit_free_list *p3 = ((struct explicit_free_list *)coalesce(bp));
-    add_node(p3, size);
+    struct arena *A;
+
+    if (IS_MAPPED(bp)) {
+        mem_munmap(MAPPING_START(bp), GET_SIZE(HDRP(bp)));
+        return;
+    }
+
+    if (IS_SLAB(bp)) {
+        if (threaded) {
+            thread_arena();
+            if (tcache_put(bp, RUN(OFFSET(bp) & ~(SLAB_RUN - 1))->cls)) {
+                return;
+            }
+        }
+        A = block_arena(bp);
+        lock_arena(A);
+        slab_free(A, bp);
+        unlock_arena(A);
+        return;
+    }
 
+    A = block_arena(bp);
+    lock_arena(A);
+    arena_free(A, bp);
+    unlock_arena(A);
 }
 
 //
-// coalesce - boundary tag coalescing. Return ptr to coalesced block
+// mm_usable_size - payload bytes of the block at bp, which can be more
+// than it was allocated with
 //
-static void *coalesce(void *bp) 
+uint32_t mm_usable_size(void *bp)
 {
-    size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
-    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
-    size_t size = GET_SIZE(HDRP(bp));
+    struct arena *A;
+    uint32_t size;
 
-    
-    if(prev_alloc && next_alloc) { return bp; }
-    
-    if (!prev_alloc && !next_alloc) {
-        delete_node((struct explicit_free_list *)PREV_BLKP(bp));
-        delete_node((struct explicit_free_list *)NEXT_BLKP(bp));
-        size += (GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(FTRP(NEXT_BLKP(bp))));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-        PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
-        bp = PREV_BLKP(bp);
+    if (IS_MAPPED(bp)) {
+        return MAPPED_PAYLOAD(bp);
     }
-
-    else if (!prev_alloc && next_alloc) {
-        delete_node((struct explicit_free_list *)PREV_BLKP(bp));
-        size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-        PUT(FTRP(bp), PACK(size, 0));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-        bp = PREV_BLKP(bp);
+    if (IS_SLAB(bp)) {
+        return RUN(OFFSET(bp) & ~(SLAB_RUN - 1))->slotSize;
     }
+    A = block_arena(bp);
+    lock_arena(A);
+    size = GET_SIZE(HDRP(bp)) - OVERHEAD;
+    unlock_arena(A);
+    return size;
+}
 
-    else if (prev_alloc && !next_alloc) {
-        delete_node((struct explicit_free_list *)NEXT_BLKP(bp)); 
-        size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        PUT(HDRP(bp), PACK(size, 0));
-        PUT(FTRP(bp), PACK(size, 0));
+//
+// mm_free_sized - mm_free for a caller that knows the size the block
+// was last allocated or reallocated with. A mapping's length follows
+// from that size, and slab objects are never bigger than SLAB_MAX, so
+// neither the mapping's header nor the slab bitmap has to be read. A
+// heap block's header is read all the same, for its prev-alloc bit.
+//
+void mm_free_sized(void *bp, uint32_t size)
+{
+    struct arena *A;
+
+    if (IS_MAPPED(bp)) {
+        char *map = MAPPING_START(bp);
+        mem_munmap(map, MAPPING_SIZE((char *)bp - map, size));
+        return;
+    }
+    if (size <= SLAB_MAX) {
+        mm_free(bp);
+        return;
     }
 
-    return bp;
+    A = block_arena(bp);
+    lock_arena(A);
+    arena_free(A, bp);
+    unlock_arena(A);
 }
 
 //
-// mm_malloc - Allocate a block with at least size bytes of payload 
+// mm_malloc_batch - Allocate n blocks of size bytes each into out[].
+// Heap blocks are carved one after the other from a single fit, so the
+// free lists are searched and updated once for the lot; slab objects
+// all come from under one lock. Returns n, or 0 with nothing allocated.
 //
-void *mm_malloc(uint32_t size) 
+int mm_malloc_batch(uint32_t size, int n, void **out)
 {
-  //
-  // You need to provide this
-  //
-    size_t adjust_size;
-    size_t extend_size;
-    char* bp;
-    
-    size = MAX(size, sizeof(struct explicit_free_list));
+    struct arena *A;
+    char *bp;
+    int i;
 
-    if (size == 0) {
-        return NULL;
+    if (size == 0 || n <= 0) {
+        return 0;
+    }
+    A = thread_arena();
+
+    if (size > MMAP_THRESHOLD
+        || (uint64_t)adjust_block_size(size) * n > MAX_HEAP / 2) {
+        for (i = 0; i < n; i++) {
+            if ((out[i] = mm_malloc(size)) == NULL) {
+                while (i-- > 0) {
+                    mm_free(out[i]);
+                }
+                return 0;
+            }
+        }
+        return n;
+    }
+
+    lock_arena(A);
+    A->opCount += n;
+    if (size <= SLAB_MAX) {
+        for (i = 0; i < n; i++) {
+            if ((out[i] = slab_malloc(A, size)) == NULL) {
+                while (i-- > 0) {
+                    slab_free(A, out[i]);
+                }
+                unlock_arena(A);
+                return 0;
+            }
+        }
+        unlock_arena(A);
+        for (i = 0; i < n; i++) {
+            count_malloc(size, ALIGN * ((size + ALIGN - 1) / ALIGN));
+        }
+        return n;
+    }
+
+    uint32_t asize = adjust_block_size(size);
+    uint32_t total = asize * n;
+    if ((bp = find_fit(A, total)) == NULL
+        && (bp = extend_heap(A, MAX(total, CHUNKSIZE) / WSIZE)) == NULL) {
+        unlock_arena(A);
+        return 0;
+    }
+    delete_node(A, (struct explicit_free_list *)bp);
+
+    //
+    // All but the last block exactly asize; the last is placed in what
+    // is left, which splits off any remainder back onto the lists
+    //
+    uint32_t rest = GET_SIZE(HDRP(bp));
+    int prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+    for (i = 0; i < n - 1; i++) {
+        PUT(HDRP(bp), PACK(asize, prev_alloc, 1));
+        out[i] = bp;
+        bp += asize;
+        rest -= asize;
+        prev_alloc = 1;
+    }
+    PUT(HDRP(bp), PACK(rest, prev_alloc, 0));
+    place(A, bp, asize);
+    out[n - 1] = bp;
+    uint32_t last = GET_SIZE(HDRP(bp));
+    unlock_arena(A);
+
+    for (i = 0; i < n - 1; i++) {
+        count_malloc(size, asize - OVERHEAD);
+    }
+    count_malloc(size, last - OVERHEAD);
+    return n;
+}
+
+static int cmp_ptr(const void *a, const void *b)
+{
+    char *x = *(char * const *)a, *y = *(char * const *)b;
+    return (x > y) - (x < y);
+}
+
+//
+// mm_free_batch - Free the n blocks in ptrs[], which it sorts by
+// address. Heap blocks that are next to each other are merged into one
+// block first, so each run of them is coalesced and put on a free list
+// once; a lock is taken once per run of blocks of the same arena.
+//
+void mm_free_batch(void **ptrs, int n)
+{
+    int i = 0;
+
+    qsort(ptrs, n, sizeof(*ptrs), cmp_ptr);
+    while (i < n) {
+        char *bp = ptrs[i];
+
+        if (IS_MAPPED(bp) || IS_SLAB(bp)) {
+            mm_free(bp);
+            i++;
+            continue;
+        }
+
+        struct arena *A = block_arena(bp);
+        lock_arena(A);
+        do {
+            char *first = ptrs[i++];
+            uint32_t span = GET_SIZE(HDRP(first));
+            int merged = 1;
+
+            //
+            // A slab object is never at the start of a block, so only
+            // heap blocks can match
+            //
+            while (i < n && (char *)ptrs[i] == first + span) {
+                span += GET_SIZE(HDRP(ptrs[i++]));
+                merged++;
+            }
+            PUT(HDRP(first), PACK(span, GET_PREV_ALLOC(HDRP(first)), 1));
+            A->opCount += merged - 1;
+            arena_free(A, first);
+        } while (i < n && !IS_MAPPED(ptrs[i]) && !IS_SLAB(ptrs[i])
+                 && block_arena(ptrs[i]) == A);
+        unlock_arena(A);
+    }
+}
+
+//
+// arena_free - free a heap block of arena A
+//
+static void arena_free(struct arena *A, void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp)), 0));
+    PUT(FTRP(bp), PACK(size, 0, 0));
+    struct explicit_free_list *p3 = ((struct explicit_free_list *)coalesce(A, bp));
+    add_node(A, p3, GET_SIZE(HDRP(p3)));
+
+    A->opCount++;
+    if (GET_SIZE(HDRP(p3)) >= RELEASE_THRESHOLD
+        && GET_SIZE(HDRP(NEXT_BLKP(p3))) != 0) {
+        //
+        // Only the pages of the block we freed: the rest of p3 was
+        // released when it was freed, or is too small to bother with
+        //
+        char *lo = (char *)MAX_PTR((char *)bp, (char *)p3 + sizeof(struct explicit_free_list));
+        char *hi = (char *)MIN_PTR((char *)bp + size - OVERHEAD, FTRP(p3));
+        mem_release(lo, hi - lo);
+    }
+    if (!threaded) {
+        trim_top(A);
+    }
+
+}
+
+//
+// trim_top - shrink the heap once a big enough free block has sat at
+// the top for TRIM_DECAY calls
+//
+static void trim_top(struct arena *A)
+{
+    char *end = A->end;
+    void *bp;
+    uint32_t size;
+
+    if (GET_PREV_ALLOC(HDRP(end))
+        || (size = GET_SIZE(HDRP(bp = PREV_BLKP(end)))) < A->trimThreshold) {
+      A->topIdleSince = 0;
+      return;
     }
+    if (!A->topIdleSince) {
+      A->topIdleSince = A->opCount;
+      return;
+    }
+    if (A->opCount - A->topIdleSince < TRIM_DECAY) {
+      return;
+    }
+
+    delete_node(A, (struct explicit_free_list *)bp);
+    PUT(HDRP(bp), PACK(TRIM_KEEP, 1, 0));
+    PUT(FTRP(bp), PACK(TRIM_KEEP, 0, 0));
+    mem_sbrk(-(int)(size - TRIM_KEEP));
+    A->end -= size - TRIM_KEEP;
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 0, 1));
+    add_node(A, (struct explicit_free_list *)bp, TRIM_KEEP);
+
+    A->trimThreshold = MAX(A->trimThreshold, 2 * size);
+    A->topIdleSince = 0;
+}
+
+//
+// coalesce - boundary tag coalescing. Return ptr to coalesced block
+//
+// Two free blocks are never adjacent, so whatever precedes the
+// coalesced block is allocated, and whatever follows it must be told
+// that its neighbour is now free.
+//
+static void *coalesce(struct arena *A, void *bp) 
+{
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+    size_t size = GET_SIZE(HDRP(bp));
+
+    my_stats()->coalesce[(!prev_alloc << 1) | !next_alloc]++;
     
-    if (size <= DSIZE) {
-        adjust_size = 2 * DSIZE;
-    } 
-    else {
-        adjust_size = DSIZE * ((size + (DSIZE) + (DSIZE - 1)) / DSIZE);
+    if (!prev_alloc && !next_alloc) {
+        delete_node(A, (struct explicit_free_list *)PREV_BLKP(bp));
+        delete_node(A, (struct explicit_free_list *)NEXT_BLKP(bp));
+        size += (GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(FTRP(NEXT_BLKP(bp))));
+        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 1, 0));
+        PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0, 0));
+        bp = PREV_BLKP(bp);
+    }
+
+    else if (!prev_alloc && next_alloc) {
+        delete_node(A, (struct explicit_free_list *)PREV_BLKP(bp));
+        size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+        PUT(FTRP(bp), PACK(size, 0, 0));
+        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 1, 0));
+        bp = PREV_BLKP(bp);
+    }
+
+    else if (prev_alloc && !next_alloc) {
+        delete_node(A, (struct explicit_free_list *)NEXT_BLKP(bp)); 
+        size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+        PUT(HDRP(bp), PACK(size, 1, 0));
+        PUT(FTRP(bp), PACK(size, 0, 0));
     }
+
+    CLEAR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+    return bp;
+}
+
+//
+// adjust_block_size - block size for a size byte payload: the payload
+// plus its header, rounded up to a doubleword and at least MIN_BLOCK
+//
+static uint32_t adjust_block_size(uint32_t size)
+{
+    return MAX(MIN_BLOCK, ALIGN * ((size + OVERHEAD + (ALIGN - 1)) / ALIGN));
+}
+
+//
+// mm_malloc - Allocate a block with at least size bytes of payload 
+//
+void *mm_malloc(uint32_t size) 
+{
+  //
+  // You need to provide this
+  //
+    struct arena *A;
+    void *bp;
+    uint32_t payload = 0;
+
+    if (size == 0) {
+        return NULL;
+    }
+    A = thread_arena();
+
+    if (size > MMAP_THRESHOLD) {
+        if ((bp = mapped_malloc(size)) != NULL) {
+            count_malloc(size, GET_SIZE(HDRP(bp)) - MMAP_OVERHEAD);
+        }
+        return bp;
+    }
+
+    if (size <= SLAB_MAX && threaded
+        && (bp = tcache_get((size + ALIGN - 1) / ALIGN - 1)) != NULL) {
+        count_malloc(size, ALIGN * ((size + ALIGN - 1) / ALIGN));
+        return bp;
+    }
+
+    lock_arena(A);
+    A->opCount++;
+    if (size <= SLAB_MAX) {
+        bp = slab_malloc(A, size);
+        payload = ALIGN * ((size + ALIGN - 1) / ALIGN);
+    }
+    else if ((bp = arena_malloc(A, size, NULL)) != NULL) {
+        payload = GET_SIZE(HDRP(bp)) - OVERHEAD;
+    }
+    unlock_arena(A);
+    if (bp != NULL) {
+        count_malloc(size, payload);
+    }
+    return bp;
+}
+
+//
+// mm_calloc - Allocate a zeroed block for nmemb elements of size bytes.
+// Mappings come zeroed from the kernel, and so does the part of a heap
+// block that comes from memory the heap has only just grown into:
+// below A->fresh and in the top block's footer is all that is cleared.
+//
+void *mm_calloc(uint32_t nmemb, uint32_t size)
+{
+    struct arena *A;
+    char *bp;
+    char *fresh;
+    char *top;
+    uint64_t total = (uint64_t)nmemb * size;
+
+    if (total == 0 || total > UINT32_MAX) {
+        return NULL;
+    }
+    size = (uint32_t)total;
+    if (size > MMAP_THRESHOLD) {
+        return mm_malloc(size);
+    }
+    if (size <= SLAB_MAX) {
+        if ((bp = mm_malloc(size)) != NULL) {
+            memset(bp, 0, size);
+        }
+        return bp;
+    }
+    A = thread_arena();
+
+    lock_arena(A);
+    A->opCount++;
+    if ((bp = arena_malloc(A, size, &fresh)) == NULL) {
+        unlock_arena(A);
+        return NULL;
+    }
+    top = A->end - DSIZE;
+    unlock_arena(A);
+    count_malloc(size, GET_SIZE(HDRP(bp)) - OVERHEAD);
+
+    fresh = MIN_PTR(MAX_PTR(fresh, bp), bp + size);
+    top = MAX_PTR(MIN_PTR(top, bp + size), fresh);
+    memset(bp, 0, fresh - bp);
+    memset(top, 0, bp + size - top);
+    return bp;
+}
+
+//
+// mm_memalign - Allocate a block with at least size bytes of payload
+// aligned to align, a power of two. Huge blocks, and ones aligned to
+// more than MMAP_THRESHOLD, get a mapping as mm_malloc's would. The rest
+// come from the heap, where the lead in front of the payload goes back
+// on the free lists, rather than from slabs.
+//
+void *mm_memalign(uint32_t align, uint32_t size)
+{
+    struct arena *A;
+    void *bp;
+    uint32_t payload = 0;
+
+    if (align <= ALIGN) {
+        return mm_malloc(size);
+    }
+    if (size == 0) {
+        return NULL;
+    }
+    if (size > MMAP_THRESHOLD || align > MMAP_THRESHOLD) {
+        if ((bp = mapped_memalign(align, size)) != NULL) {
+            count_malloc(size, MAPPED_PAYLOAD(bp));
+        }
+        return bp;
+    }
+    A = thread_arena();
+
+    lock_arena(A);
+    A->opCount++;
+    if ((bp = alloc_aligned(A, adjust_block_size(size), align)) != NULL) {
+        payload = GET_SIZE(HDRP(bp)) - OVERHEAD;
+    }
+    unlock_arena(A);
+    if (bp != NULL) {
+        count_malloc(size, payload);
+    }
+    return bp;
+}
+
+//
+// arena_malloc - allocate a heap block from arena A. If fresh isn't
+// NULL, it is set to where the block's payload starts reading as zeros
+// (possibly past its end), as place() returns.
+//
+static void *arena_malloc(struct arena *A, uint32_t size, char **fresh)
+{
+    char *zero;
+    size_t adjust_size;
+    size_t extend_size;
+    char* bp;
+
+    adjust_size = adjust_block_size(size);
     
-    if ((bp = find_fit(adjust_size)) != NULL) {
-        delete_node((struct explicit_free_list *)bp);
-        place(bp, adjust_size);
+    if ((bp = find_fit(A, adjust_size)) != NULL) {
+        delete_node(A, (struct explicit_free_list *)bp);
+        zero = place(A, bp, adjust_size);
+        if (fresh != NULL) {
+            *fresh = zero;
+        }
         return bp;
     }
     
     extend_size = MAX(adjust_size, CHUNKSIZE);
     
-    if ((bp = extend_heap(extend_size / WSIZE)) == NULL) {
+    if ((bp = extend_heap(A, extend_size / WSIZE)) == NULL) {
         return NULL;
     }
     
-    delete_node((struct explicit_free_list *)bp);
-    place(bp, adjust_size);
+    delete_node(A, (struct explicit_free_list *)bp);
+    zero = place(A, bp, adjust_size);
+    if (fresh != NULL) {
+        *fresh = zero;
+    }
     return bp;
 } 
 
@@ -338,23 +1330,32 @@ void *mm_malloc(uint32_t size)
 // place - Place block of asize bytes at start of free block bp 
 //         and split if remainder would be at least minimum block size
 //
-static void place(void *bp, uint32_t asize)
+// Returns A->fresh as it was: from there to the top block's footer the
+// heap reads as zeros. Afterwards it is past the block and whatever
+// free block header and links follow it, since the caller may write
+// the lot.
+//
+static char *place(struct arena *A, void *bp, uint32_t asize)
 {
     int cur_size = GET_SIZE(HDRP(bp));
-    int min = (sizeof(struct explicit_free_list) + OVERHEAD);
+    int prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+    char *fresh = A->fresh;
     
-    if (cur_size - asize >= min) {
-        PUT(HDRP(bp), PACK(asize, 1));
-        PUT(FTRP(bp), PACK(asize, 1));
+    if (cur_size - asize >= MIN_BLOCK) {
+        A->fresh = MAX_PTR(fresh, (char *)bp + asize + sizeof(struct explicit_free_list));
+        my_stats()->splits++;
+        PUT(HDRP(bp), PACK(asize, prev_alloc, 1));
         bp = NEXT_BLKP(bp);
-        PUT(HDRP(bp), PACK(cur_size - asize, 0));
-        PUT(FTRP(bp), PACK(cur_size - asize, 0));
-        add_node(((struct explicit_free_list *)bp), (cur_size - asize));
+        PUT(HDRP(bp), PACK(cur_size - asize, 1, 0));
+        PUT(FTRP(bp), PACK(cur_size - asize, 0, 0));
+        add_node(A, ((struct explicit_free_list *)bp), (cur_size - asize));
     }
     else {
-        PUT(HDRP(bp), PACK(cur_size, 1));
-        PUT(FTRP(bp), PACK(cur_size, 1));
+        A->fresh = MAX_PTR(fresh, (char *)bp + cur_size + sizeof(struct explicit_free_list));
+        PUT(HDRP(bp), PACK(cur_size, prev_alloc, 1));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
     }
+    return fresh;
 }
 
 
@@ -365,41 +1366,318 @@ void *mm_realloc(void *ptr, uint32_t size)
 {
   void *newp;
   uint32_t copySize;
-  
-  int min_size = MAX(size, sizeof(struct explicit_free_list)) + OVERHEAD;
-  int size_block = GET_SIZE(HDRP(ptr));
+  uint32_t payload;
 
-  if (size_block == min_size){
-    return ptr;
+  //
+  // A mapping is resized by moving its pages rather than its bytes, a
+  // slab object can grow within its slot, and a block within its block,
+  // the free block after it, or the end of the heap. Blocks growing past
+  // MMAP_THRESHOLD are copied out to a mapping once.
+  //
+  if (IS_MAPPED(ptr)) {
+    payload = MAPPED_PAYLOAD(ptr);
+    if (size > MMAP_THRESHOLD && (newp = mapped_resize(ptr, size)) != NULL) {
+      if (newp == ptr) {
+        count(&reallocStats.in_place, 1);
+      }
+      else {
+        count(&reallocStats.remapped, 1);
+      }
+      count(&reallocStats.bytes_avoided, MIN(size, payload));
+      return newp;
+    }
   }
-  else if (size_block > min_size){
-    place(ptr, size_block);
-    return ptr;
+  else if (IS_SLAB(ptr)) {
+    payload = RUN(OFFSET(ptr) & ~(SLAB_RUN - 1))->slotSize;
+    if (size <= payload){
+      count(&reallocStats.in_place, 1);
+      count(&reallocStats.bytes_avoided, MIN(size, payload));
+      return ptr;
+    }
   }
+  else {
+    struct arena *A = block_arena(ptr);
+    int kept;
 
-  newp = mm_malloc(size);
-    
-  if (newp == NULL){
-    printf("ERROR: mm_malloc failed in mm_realloc\n");
-    exit(1);
+    //
+    // The header's prev-alloc bit belongs to the arena, so even the
+    // size is read under its lock
+    //
+    lock_arena(A);
+    payload = GET_SIZE(HDRP(ptr)) - OVERHEAD;
+    kept = GET_SIZE(HDRP(ptr)) >= adjust_block_size(size)
+      || (size <= MMAP_THRESHOLD && grow_block(A, ptr, size));
+    unlock_arena(A);
+    if (kept) {
+      count(&reallocStats.in_place, 1);
+      count(&reallocStats.bytes_avoided, MIN(size, payload));
+      return ptr;
+    }
   }
-    
-  copySize = GET_SIZE(HDRP(ptr));
 
-  if (size < copySize){
-    copySize = size;
+  //
+  // Like realloc, a failure leaves the old block as it was
+  //
+  if ((newp = mm_malloc(size)) == NULL){
+    return NULL;
   }
     
+  copySize = MIN(size, payload);
   memcpy(newp, ptr, copySize);
   mm_free(ptr);
-    
+
+  count(&reallocStats.moved, 1);
+  count(&reallocStats.bytes_copied, copySize);
   return newp;
 }
 
+//
+// grow_block - try to make allocated block bp big enough for a size
+// byte payload without moving it, by absorbing the free block after it
+// and, when that is the end of the heap, extending the heap by just the
+// missing bytes (or MIN_BLOCK, the smallest free block extend_heap
+// can make). Returns 0 if bp has to move.
+//
+static int grow_block(struct arena *A, void *bp, uint32_t size)
+{
+    uint32_t asize = adjust_block_size(size);
+    uint32_t cur_size = GET_SIZE(HDRP(bp));
+    void *next = NEXT_BLKP(bp);
+    uint32_t avail = cur_size;
+    int at_top = next == A->end;
+
+    if (!GET_ALLOC(HDRP(next))) {
+      avail += GET_SIZE(HDRP(next));
+      at_top = NEXT_BLKP(next) == A->end;
+    }
+
+    if (avail < asize) {
+      if (!at_top || extend_heap(A, MAX(asize - avail, MIN_BLOCK) / WSIZE) == NULL) {
+        return 0;
+      }
+      //
+      // The extension may have gone to a new piece of the arena
+      //
+      next = NEXT_BLKP(bp);
+      avail = cur_size + GET_SIZE(HDRP(next));
+      if (GET_ALLOC(HDRP(next)) || avail < asize) {
+        return 0;
+      }
+    }
+
+    //
+    // Hand place() the merged block as if it were a free one; it puts
+    // back whatever is left over and fixes the next prev-alloc bit
+    //
+    delete_node(A, (struct explicit_free_list *)next);
+    PUT(HDRP(bp), PACK(avail, GET_PREV_ALLOC(HDRP(bp)), 1));
+    place(A, bp, asize);
+
+    count(&reallocStats.grown, 1);
+    return 1;
+}
+
+//
+// mapped_malloc - a dedicated mapping for a huge request
+//
+static void *mapped_malloc(uint32_t size)
+{
+    uint32_t len = MAPPING_SIZE(MMAP_OVERHEAD, size);
+    char *map = mem_mmap(len);
+
+    if (map == (void *)-1) {
+      return NULL;
+    }
+    PUT(map + MMAP_OVERHEAD - WSIZE, PACK(len, 1, 1));
+    return map + MMAP_OVERHEAD;
+}
+
+//
+// mapped_memalign - a dedicated mapping for a huge or very aligned
+// request. Up to a page of alignment any mapping will do; beyond that
+// memlib maps extra and trims it.
+//
+static void *mapped_memalign(uint32_t align, uint32_t size)
+{
+    uint32_t page = mem_pagesize();
+    uint32_t lead = MIN(align, page);
+    uint32_t len = MAPPING_SIZE(lead, size);
+    char *map = (align <= page) ? mem_mmap(len) : mem_mmap_aligned(len, align, lead);
+
+    if (map == (void *)-1) {
+      return NULL;
+    }
+    PUT(map + lead - WSIZE, PACK(len, 1, 1));
+    return map + lead;
+}
+
+//
+// mapped_resize - remap a huge block to fit a size byte payload; NULL
+// if the mapping could not be resized (the block is left as it was).
+// The payload stays as far into the mapping as it was.
+//
+static void *mapped_resize(void *bp, uint32_t size)
+{
+    char *map = MAPPING_START(bp);
+    uint32_t lead = (char *)bp - map;
+    uint32_t len = MAPPING_SIZE(lead, size);
+    uint32_t oldlen = GET_SIZE(HDRP(bp));
+
+    if (len == oldlen) {
+      return bp;
+    }
+    map = mem_mremap(map, oldlen, len);
+    if (map == (void *)-1) {
+      return NULL;
+    }
+    PUT(map + lead - WSIZE, PACK(len, 1, 1));
+    return map + lead;
+}
+
+//
+// mm_realloc_stats - copy out the realloc counters
+//
+void mm_realloc_stats(mm_realloc_stats_t *stats)
+{
+  *stats = reallocStats;
+}
+
+//
+// add_stats - add the counters of from to those of to
+//
+static void add_stats(mm_stats_t *to, const mm_stats_t *from)
+{
+  uint64_t *t = (uint64_t *)to;
+  const uint64_t *f = (const uint64_t *)from;
+
+  for (size_t i = 0; i < sizeof(mm_stats_t) / sizeof(uint64_t); i++) {
+    t[i] += f[i];
+  }
+}
+
+//
+// mm_stats - the counters of every thread, added up. Those of threads
+// still running may be a little behind.
+//
+void mm_stats(mm_stats_t *stats)
+{
+  pthread_mutex_lock(&statsLock);
+  *stats = exitedStats;
+  for (struct thread_stats *T = allStats; T != NULL; T = T->next) {
+    add_stats(stats, &T->s);
+  }
+  pthread_mutex_unlock(&statsLock);
+}
+
+//
+// stats_exit - pthread key destructor: fold an exiting thread's
+// counters into exitedStats and take it off allStats
+//
+static void stats_exit(void *arg)
+{
+  struct thread_stats *T = arg, **pp;
+
+  pthread_mutex_lock(&statsLock);
+  add_stats(&exitedStats, &T->s);
+  for (pp = &allStats; *pp != T; pp = &(*pp)->next)
+    ;
+  *pp = T->next;
+  memset(T, 0, sizeof(*T));
+  pthread_mutex_unlock(&statsLock);
+}
+
+static void make_stats_key(void)
+{
+  pthread_key_create(&statsKey, stats_exit);
+}
+
+//
+// register_stats - put the calling thread's counters on allStats, the
+// first time it counts anything
+//
+static mm_stats_t *register_stats(void)
+{
+  pthread_once(&statsOnce, make_stats_key);
+  pthread_mutex_lock(&statsLock);
+  threadStats.next = allStats;
+  allStats = &threadStats;
+  threadStats.registered = 1;
+  pthread_mutex_unlock(&statsLock);
+  pthread_setspecific(statsKey, &threadStats);
+  return &threadStats.s;
+}
+
+//
+// mm_heapwalk - walk the blocks of every piece of heap, as
+// mm_checkheap does, summing the free ones by size class. If heat
+// isn't NULL, the bytes of allocated blocks (slab runs with all their
+// slots) are also added up in cells of cell_bytes from the start of
+// the heap; blocks past the last cell are left out.
+//
+void mm_heapwalk(mm_heapwalk_t *walk, uint32_t *heat, int cells, uint32_t cell_bytes)
+{
+  memset(walk, 0, sizeof(*walk));
+  if (heat != NULL) {
+    memset(heat, 0, cells * sizeof(*heat));
+  }
+
+  for (int p = 0; p < npieces; p++) {
+    for (char *bp = pieces[p]; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+      uint32_t size = GET_SIZE(HDRP(bp));
+
+      if (!GET_ALLOC(HDRP(bp))) {
+        walk->free_blocks++;
+        walk->free_bytes += size;
+        walk->class_bytes[sizeToIndex(size)] += size;
+        if (size > walk->largest_free) {
+          walk->largest_free = size;
+        }
+      }
+      else if (heat != NULL) {
+        size_t lo = (char *)HDRP(bp) - heap_base, hi = lo + size;
+        for (size_t c = lo / cell_bytes; c < (size_t)cells && lo < hi; c++) {
+          size_t end = (c + 1) * cell_bytes < hi ? (c + 1) * cell_bytes : hi;
+          heat[c] += end - lo;
+          lo = end;
+        }
+      }
+    }
+  }
+}
+
+//
+// mm_class_floor - the smallest block size that sizeToIndex puts in
+// class cls, or 0 if no block can be in it: blocks are doublewords,
+// at least MIN_BLOCK and at most MAX_HEAP
+//
+uint32_t mm_class_floor(int cls)
+{
+  int fl = cls / SL_COUNT, sl = cls % SL_COUNT;
+
+  if (cls < 0 || cls >= LISTSIZE || (1u << fl) < MIN_BLOCK / 2) {
+    return 0;
+  }
+  uint64_t lo = (1ull << fl) + ((uint64_t)sl << (fl - SL_BITS));
+  uint64_t hi = lo + (1ull << (fl - SL_BITS));
+  uint64_t size = ALIGN * ((lo + ALIGN - 1) / ALIGN);
+  return (size < MIN_BLOCK || size >= hi || size > MAX_HEAP) ? 0 : (uint32_t)size;
+}
+
 //
 // mm_checkheap - Check the heap for consistency 
 //
 void mm_checkheap(int verbose) 
+{
+  for (int p = 0; p < npieces; p++) {
+    checkpiece(pieces[p], verbose);
+  }
+}
+
+//
+// checkpiece - check the blocks of one piece of heap, from the
+// prologue to the epilogue
+//
+static void checkpiece(char *heap_listp, int verbose)
 {
   //
   // This provided implementation assumes you're using the structure
@@ -415,14 +1693,25 @@ void mm_checkheap(int verbose)
   if ((GET_SIZE(HDRP(heap_listp)) != DSIZE) || !GET_ALLOC(HDRP(heap_listp))) {
 	printf("Bad prologue header\n");
   }
-    
-  checkblock(heap_listp);
+  if (verbose) {
+    printblock(heap_listp);
+  }
 
-  for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+  //
+  // Walk the blocks after the prologue (whose payload is never handed
+  // out, so needn't be aligned) remembering whether the last one was
+  // allocated, which is what each header's prev-alloc bit has to say
+  //
+  int prev_alloc = 1;
+  for (bp = NEXT_BLKP(heap_listp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
     if (verbose)  {
       printblock(bp);
     }
-    checkblock(bp);
+    checkblock(bp, prev_alloc);
+    if (GET_ALLOC(HDRP(bp)) && IS_SLAB(bp)) {
+      checkrun(bp);
+    }
+    prev_alloc = GET_ALLOC(HDRP(bp));
   }
      
   if (verbose) {
@@ -432,55 +1721,295 @@ void mm_checkheap(int verbose)
   if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp)))) {
     printf("Bad epilogue header\n");
   }
+  if (GET_PREV_ALLOC(HDRP(bp)) != prev_alloc) {
+    printf("Error: epilogue prev-alloc bit is wrong\n");
+  }
 }
 
 static void printblock(void *bp) 
 {
-  uint32_t hsize, halloc, fsize, falloc;
+  uint32_t hsize, halloc, hprev;
 
   hsize = GET_SIZE(HDRP(bp));
   halloc = GET_ALLOC(HDRP(bp));  
-  fsize = GET_SIZE(FTRP(bp));
-  falloc = GET_ALLOC(FTRP(bp));  
+  hprev = GET_PREV_ALLOC(HDRP(bp));
     
   if (hsize == 0) {
     printf("%p: EOL\n", bp);
     return;
   }
 
-  printf("%p: header: [%d:%c] footer: [%d:%c]\n",
-	 bp, 
-	 (int) hsize, (halloc ? 'a' : 'f'), 
-	 (int) fsize, (falloc ? 'a' : 'f')); 
+  if (halloc) {
+    printf("%p: header: [%d:%c%c]\n",
+	   bp, 
+	   (int) hsize, (hprev ? 'a' : 'f'), 'a');
+  }
+  else {
+    printf("%p: header: [%d:%c%c] footer: [%d]\n",
+	   bp, 
+	   (int) hsize, (hprev ? 'a' : 'f'), 'f',
+	   (int) GET_SIZE(FTRP(bp))); 
+  }
+}
+
+static void checkblock(void *bp, int prev_alloc) 
+{
+  if ((uintptr_t)bp % ALIGN) {
+    printf("Error: %p is not %d byte aligned\n", bp, ALIGN);
+  }
+  if (GET_PREV_ALLOC(HDRP(bp)) != prev_alloc) {
+    printf("Error: %p prev-alloc bit is wrong\n", bp);
+  }
+  if (!GET_ALLOC(HDRP(bp))) {
+    if (!prev_alloc) {
+      printf("Error: %p and the block before it are both free\n", bp);
+    }
+    if (GET_SIZE(HDRP(bp)) != GET_SIZE(FTRP(bp))) {
+      printf("Error: header does not match footer\n");
+    }
+  }
+}
+
+static void checkrun(void *bp)
+{
+  struct slab_run *run = (struct slab_run *)bp;
+  int nfree = 0;
+
+  if (OFFSET(bp) % SLAB_RUN) {
+    printf("Error: slab run %p is not aligned\n", bp);
+    return;
+  }
+  if (run->cls >= SLAB_CLASSES || run->slotSize != (run->cls + 1) * ALIGN
+      || run->nslots != (SLAB_BYTES - sizeof(struct slab_run)) / run->slotSize) {
+    printf("Error: slab run %p has a bad header\n", bp);
+    return;
+  }
+  for (int w = 0; w < SLAB_MAP_WORDS; w++) {
+    nfree += __builtin_popcountll(run->freeMap[w]);
+  }
+  if (nfree != run->nfree) {
+    printf("Error: slab run %p counts %d free slots, bitmap has %d\n",
+	   bp, run->nfree, nfree);
+  }
+}
+
+//
+// add_node - push a free block on the list for its size class. The
+// block must go in the class of its current (post-coalesce) size or
+// find_fit's "any block in a higher class fits" rule breaks.
+//
+static void add_node(struct arena *A, struct explicit_free_list *node, uint32_t memorySize)
+{
+  int i = sizeToIndex(memorySize);
+  uint32_t offset = OFFSET(node);
+  node->next = A->start[i];
+  node->prev = 0;
+  if (A->start[i]) {
+    NODE(A->start[i])->prev = offset;
+  }
+  A->start[i] = offset;
+  A->slBitmap[i / SL_COUNT] |= 1u << (i % SL_COUNT);
+  A->flBitmap |= 1u << (i / SL_COUNT);
+}
+
+//
+// delete_node - unlink a free block. Its header must still hold the
+// size it was added with, which is how we find its list.
+//
+static void delete_node(struct arena *A, struct explicit_free_list *p)
+{
+  int i = sizeToIndex(GET_SIZE(HDRP(p)));
+
+  if (p->prev) {
+    NODE(p->prev)->next = p->next;
+  }
+  else {
+    A->start[i] = p->next;
+  }
+  if (p->next) {
+    NODE(p->next)->prev = p->prev;
+  }
+  p->next = 0;
+  p->prev = 0;
+
+  if (!A->start[i]) {
+    int fl = i / SL_COUNT;
+    A->slBitmap[fl] &= ~(1u << (i % SL_COUNT));
+    if (A->slBitmap[fl] == 0) {
+      A->flBitmap &= ~(1u << fl);
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Slab tier
+//
+
+static void push_run(struct arena *A, struct slab_run *run)
+{
+  uint32_t offset = OFFSET(run);
+  run->next = A->slabPartial[run->cls];
+  run->prev = 0;
+  if (run->next) {
+    RUN(run->next)->prev = offset;
+  }
+  A->slabPartial[run->cls] = offset;
+}
+
+static void unlink_run(struct arena *A, struct slab_run *run)
+{
+  if (run->prev) {
+    RUN(run->prev)->next = run->next;
+  }
+  else {
+    A->slabPartial[run->cls] = run->next;
+  }
+  if (run->next) {
+    RUN(run->next)->prev = run->prev;
+  }
 }
 
-static void checkblock(void *bp) 
+//
+// new_run - carve a fresh, all free run for class cls out of the heap
+//
+static struct slab_run *new_run(struct arena *A, int cls)
 {
-  if ((uintptr_t)bp % 8) {
-    printf("Error: %p is not doubleword aligned\n", bp);
+  struct slab_run *run = alloc_aligned(A, adjust_block_size(SLAB_BYTES), SLAB_RUN);
+  if (run == NULL) {
+    return NULL;
   }
-  if (GET(HDRP(bp)) != GET(FTRP(bp))) {
-    printf("Error: header does not match footer\n");
+
+  run->cls = cls;
+  run->slotSize = (cls + 1) * ALIGN;
+  run->nslots = (SLAB_BYTES - sizeof(struct slab_run)) / run->slotSize;
+  run->nfree = run->nslots;
+  memset(run->freeMap, 0, sizeof(run->freeMap));
+  for (int slot = 0; slot < run->nslots; slot += 64) {
+    int n = run->nslots - slot;
+    run->freeMap[slot / 64] = (n >= 64) ? ~0ULL : (1ULL << n) - 1;
   }
+
+  uint32_t page = OFFSET(run) / SLAB_RUN;
+  __atomic_fetch_or(&slabPages[page / 32], 1u << (page % 32), __ATOMIC_RELAXED);
+  push_run(A, run);
+  return run;
 }
 
-void add_node(struct explicit_free_list *node, uint32_t memorySize)
+//
+// slab_malloc - lowest free slot of the first partly used run
+//
+static void *slab_malloc(struct arena *A, uint32_t size)
 {
-  struct explicit_free_list *p = &start[sizeToIndex(memorySize)];
-  node->next = p->next;
-  node->prev = p;
-  p->next->prev = node;
-  p->next = node;
+  int cls = (size + ALIGN - 1) / ALIGN - 1;
+  struct slab_run *run;
+
+  if (A->slabPartial[cls]) {
+    run = RUN(A->slabPartial[cls]);
+  }
+  else if ((run = new_run(A, cls)) == NULL) {
+    return NULL;
+  }
+
+  int w = 0;
+  while (run->freeMap[w] == 0) {
+    w++;
+  }
+  int slot = w * 64 + __builtin_ctzll(run->freeMap[w]);
+  run->freeMap[w] &= run->freeMap[w] - 1;
+  if (--run->nfree == 0) {
+    unlink_run(A, run);
+  }
+  return SLOTS(run) + slot * run->slotSize;
 }
 
-void delete_node(struct explicit_free_list *p)
+//
+// slab_free - give the slot back. A run that empties goes back to the
+// heap unless it is the only partly used run of its class, so an
+// alloc/free pair at the edge of a run doesn't carve and release a
+// page every time.
+//
+static void slab_free(struct arena *A, void *bp)
 {
-  p->next->prev = p->prev;
-  p->prev->next = p->next;
-  p->next = NULL;
-  p->prev = NULL;
+  struct slab_run *run = RUN(OFFSET(bp) & ~(SLAB_RUN - 1));
+  int slot = ((char *)bp - SLOTS(run)) / run->slotSize;
+
+  run->freeMap[slot / 64] |= 1ULL << (slot % 64);
+  if (run->nfree++ == 0) {
+    push_run(A, run);
+  }
+
+  if (run->nfree == run->nslots && (run->prev || run->next)) {
+    uint32_t page = OFFSET(run) / SLAB_RUN;
+    unlink_run(A, run);
+    __atomic_fetch_and(&slabPages[page / 32], ~(1u << (page % 32)), __ATOMIC_RELAXED);
+    arena_free(A, run);
+  }
 }
 
+//
+// aligned_lead - bytes to skip from bp to an aligned payload, either 0
+// or enough to leave a free block of at least MIN_BLOCK behind
+//
+static uint32_t aligned_lead(void *bp, uint32_t align)
+{
+  uint32_t lead = (align - (uintptr_t)bp % align) % align;
+  if (lead != 0 && lead < MIN_BLOCK) {
+    lead += align;
+  }
+  return lead;
+}
 
+//
+// alloc_aligned - allocate a block of asize bytes whose payload is
+// aligned to align (a power of two). The heap starts on a page, so up
+// to SLAB_RUN that is also aligned relative to heap_base. The free
+// block is split in up to three: a free lead, the aligned block, and
+// whatever place() trims.
+//
+static void *alloc_aligned(struct arena *A, uint32_t asize, uint32_t align)
+{
+  char *bp;
 
+  if ((bp = find_fit(A, asize + align + MIN_BLOCK)) == NULL) {
+    //
+    // Nothing free fits whatever lead it needs, so grow the heap by
+    // exactly what the block at the top needs instead; a full align
+    // worth of slack would be stranded as a lead at every call. An
+    // arena's extension can also start a new piece (or its first one),
+    // where the lead is different, so we look again after growing.
+    //
+    uint32_t need = 0;
+    uint32_t have = 0;
+    char *top;
+    for (;;) {
+      if ((top = A->end) != NULL) {
+        if (!GET_PREV_ALLOC(HDRP(top))) {
+          top = PREV_BLKP(top);
+        }
+        need = aligned_lead(top, align) + asize;
+        have = A->end - top;
+        if (need <= have) {
+          break;
+        }
+      }
+      if (extend_heap(A, MAX(need - have, MIN_BLOCK) / WSIZE) == NULL) {
+        return NULL;
+      }
+    }
+    bp = top;
+  }
+  delete_node(A, (struct explicit_free_list *)bp);
 
+  uint32_t lead = aligned_lead(bp, align);
+  if (lead) {
+    uint32_t size = GET_SIZE(HDRP(bp));
+    PUT(HDRP(bp), PACK(lead, GET_PREV_ALLOC(HDRP(bp)), 0));
+    PUT(FTRP(bp), PACK(lead, 0, 0));
+    add_node(A, (struct explicit_free_list *)bp, lead);
+    bp += lead;
+    PUT(HDRP(bp), PACK(size - lead, 0, 0));
+  }
+  place(A, bp, asize);
+  return bp;
+}
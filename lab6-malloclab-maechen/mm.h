@@ -2,9 +2,87 @@
 #include <stdint.h>
 
 extern int mm_init (void);
+/*
+ * Like mm_init, but for use from several threads at once: the heap is
+ * split between up to 16 arenas, each with its own lock, and each
+ * thread caches some of the small blocks it frees
+ */
+extern int mm_init_threads (int arenas);
 extern void *mm_malloc (uint32_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, uint32_t size);
+/* nmemb * size zeroed bytes; NULL if that overflows */
+extern void *mm_calloc(uint32_t nmemb, uint32_t size);
+/* align is a power of two */
+extern void *mm_memalign(uint32_t align, uint32_t size);
+/*
+ * n blocks of size bytes into out[], from one search of the free
+ * lists; returns n, or 0 with nothing allocated
+ */
+extern int mm_malloc_batch(uint32_t size, int n, void **out);
+/* Frees n blocks together, merging neighbours first; sorts ptrs[] */
+extern void mm_free_batch(void **ptrs, int n);
+/* size is what the block was last allocated or reallocated with */
+extern void mm_free_sized(void *ptr, uint32_t size);
+/* Payload bytes the block really has */
+extern uint32_t mm_usable_size(void *ptr);
+
+/*
+ * What mm_realloc has done since the last mm_init. "Avoided" counts
+ * the payload bytes a malloc + copy + free would have moved for the
+ * reallocs that kept their block.
+ */
+typedef struct {
+    uint64_t in_place;       /* reallocs that returned the same block */
+    uint64_t grown;          /* ...of which grew it into the next block or the heap */
+    uint64_t remapped;       /* huge reallocs moved by remapping, not copying */
+    uint64_t moved;          /* reallocs that had to copy */
+    uint64_t bytes_copied;
+    uint64_t bytes_avoided;
+} mm_realloc_stats_t;
+
+extern void mm_realloc_stats(mm_realloc_stats_t *stats);
+
+/*
+ * A snapshot of the heap's blocks for the driver's fragmentation
+ * timeline. Only heap blocks are seen: free slab slots, blocks cached
+ * by threads and huge blocks with mappings of their own aren't. Not to
+ * be taken while other threads are using the package.
+ */
+#define MM_CLASSES 256
+
+typedef struct {
+    uint32_t free_blocks;
+    uint32_t largest_free;
+    uint64_t free_bytes;
+    uint64_t class_bytes[MM_CLASSES]; /* free bytes by free list size class */
+} mm_heapwalk_t;
+
+extern void mm_heapwalk(mm_heapwalk_t *walk, uint32_t *heat, int cells,
+                        uint32_t cell_bytes);
+/* Smallest block in a size class, 0 if the class is always empty */
+extern uint32_t mm_class_floor(int cls);
+
+/*
+ * What the package has done since the last init. Each thread counts
+ * on its own, without atomics, and mm_stats adds the threads up.
+ * coalesce[] is indexed by which neighbours of a block being freed (or
+ * added at the top of the heap) were free: 0 neither, 1 the next one,
+ * 2 the previous one, 3 both.
+ */
+typedef struct {
+    uint64_t mallocs[MM_CLASSES]; /* allocations by the size class of their block */
+    uint64_t requested;      /* payload bytes they asked for */
+    uint64_t handed_out;     /* payload bytes their blocks had room for */
+    uint64_t fits;           /* find_fit searches */
+    uint64_t fit_probes;     /* free blocks they looked at */
+    uint64_t coalesce[4];
+    uint64_t splits;         /* blocks placed with the rest split off as free */
+    uint64_t heap_grows;     /* extend_heap calls */
+    uint64_t heap_grown;     /* ...and the bytes they added */
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *stats);
 
 
 /* 
@@ -0,0 +1,511 @@
+/*
+ * mmgen.c - generate a synthetic trace from a parameterized workload
+ *     model. The same seed and parameters always give the same trace.
+ *
+ * Every block is allocated with a size from the current size
+ * distribution and is one of three kinds:
+ *   - a cache entry (-c), live until the end unless pushed out,
+ *   - a vector (-v), reallocated by the growth factor at the points a
+ *     push_back at a steady rate would fill it, then freed, or
+ *   - an ordinary block, freed when its lifetime runs out.
+ * Lifetimes are counted in requests. fixed lifetimes free blocks in
+ * the order they were allocated, like a producer/consumer queue. When
+ * a new block would take the live bytes past the target, the blocks
+ * due to die soonest are freed first (cache entries last). Whatever is
+ * still live at the end is freed, so the trace is balanced and holds
+ * exactly the requested number of requests (one less if that's odd).
+ *
+ * Distributions are written <shape>:<params>:
+ *   fixed:<n>  uniform:<lo>:<hi>  exp:<mean>
+ *   lognormal:<median>:<sigma>  pow2:<lo>:<hi> (powers of two in range)
+ */
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define MAX_PHASES 16
+#define MAX_GROWS 30
+#define MAX_SIZE (1u << 30)
+#define FOREVER UINT64_MAX
+
+typedef enum
+{
+	FIXED,
+	UNIFORM,
+	EXP,
+	LOGNORMAL,
+	POW2
+} shape_t;
+
+typedef struct
+{
+	shape_t shape;
+	double a, b;
+} dist_t;
+
+/* The model */
+typedef struct
+{
+	long ops;
+	uint64_t live_target;
+	dist_t sizes[MAX_PHASES]; /* sizes[i] from request phase_start[i] on */
+	long phase_start[MAX_PHASES];
+	int phases;
+	dist_t lifetimes;
+	double cache_frac;
+	double vector_frac;
+	double growth;
+	uint32_t vector_max;
+	uint64_t seed;
+} model_t;
+
+typedef struct
+{
+	uint64_t born;
+	uint64_t life;
+	uint32_t size;
+	uint32_t grows; /* reallocs still to come */
+} block_t;
+
+typedef struct
+{
+	uint64_t time;
+	uint32_t id;
+} event_t;
+
+/* One run of the model */
+typedef struct
+{
+	FILE *out; /* NULL: just count */
+	int binary;
+	uint64_t rng;
+	block_t *blocks;
+	size_t maxblocks;
+	event_t *heap; /* next event of every live block, soonest first */
+	size_t nheap, maxheap;
+	long ops;
+	long ids;
+	uint64_t live;
+	uint64_t peak;
+} gen_t;
+
+static void usage(void);
+
+static void app_error(const char *msg)
+{
+	fprintf(stderr, "mmgen: %s\n", msg);
+	exit(1);
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+	if ((p = realloc(p, size)) == NULL)
+		app_error("out of memory");
+	return p;
+}
+
+/*
+ * Random numbers: splitmix64, so a seed means the same trace anywhere
+ */
+
+static uint64_t next_random(gen_t *g)
+{
+	uint64_t z = (g->rng += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+/* Uniform on (0, 1] */
+static double uniform01(gen_t *g)
+{
+	return ((next_random(g) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static double sample(gen_t *g, const dist_t *d)
+{
+	double u = uniform01(g);
+
+	switch (d->shape)
+	{
+	case FIXED:
+		return d->a;
+	case UNIFORM:
+		return d->a + (d->b - d->a) * u;
+	case EXP:
+		return -d->a * log(u);
+	case LOGNORMAL:
+		return d->a * exp(d->b * sqrt(-2 * log(u)) * cos(2 * M_PI * uniform01(g)));
+	case POW2:
+	{
+		double lo = ceil(log2(d->a)), hi = floor(log2(d->b));
+		return exp2(lo + floor((hi - lo + 1) * (1 - u)));
+	}
+	}
+	return 0;
+}
+
+static int parse_dist(const char *spec, dist_t *d)
+{
+	static const struct
+	{
+		const char *name;
+		shape_t shape;
+		int nparams;
+	} shapes[] = {
+		{"fixed", FIXED, 1},
+		{"uniform", UNIFORM, 2},
+		{"exp", EXP, 1},
+		{"lognormal", LOGNORMAL, 2},
+		{"pow2", POW2, 2},
+	};
+	const char *colon = strchr(spec, ':');
+	size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+	char extra;
+	int i, n;
+
+	for (i = 0; i < (int)(sizeof(shapes) / sizeof(shapes[0])); i++)
+	{
+		if (strlen(shapes[i].name) != len || strncmp(spec, shapes[i].name, len) != 0)
+			continue;
+		d->shape = shapes[i].shape;
+		d->b = 0;
+		if (colon == NULL)
+			return 0;
+		n = sscanf(colon + 1, "%lf:%lf%c", &d->a, &d->b, &extra);
+		if (n != shapes[i].nparams || d->a < 0 || d->b < 0)
+			return 0;
+		if ((d->shape == UNIFORM || d->shape == POW2) && d->b < d->a)
+			return 0;
+		if (d->shape == POW2 && (d->a < 1 || ceil(log2(d->a)) > floor(log2(d->b))))
+			return 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* A byte count, optionally with a K, M or G suffix */
+static uint64_t parse_bytes(const char *s)
+{
+	char *end;
+	uint64_t n = strtoull(s, &end, 0);
+
+	switch (*end)
+	{
+	case 'G':
+		n <<= 10;
+		/* fall through */
+	case 'M':
+		n <<= 10;
+		/* fall through */
+	case 'K':
+		n <<= 10;
+		end++;
+	}
+	if (*end != '\0')
+		app_error("bad byte count");
+	return n;
+}
+
+/*
+ * Event heap
+ */
+
+static void push_event(gen_t *g, uint64_t time, uint32_t id)
+{
+	size_t i = g->nheap++, parent;
+
+	if (g->nheap > g->maxheap)
+	{
+		g->maxheap = g->maxheap ? 2 * g->maxheap : 1024;
+		g->heap = xrealloc(g->heap, g->maxheap * sizeof(event_t));
+	}
+	for (; i > 0 && g->heap[parent = (i - 1) / 2].time > time; i = parent)
+		g->heap[i] = g->heap[parent];
+	g->heap[i].time = time;
+	g->heap[i].id = id;
+}
+
+static event_t pop_event(gen_t *g)
+{
+	event_t top = g->heap[0], last = g->heap[--g->nheap];
+	size_t i = 0, c;
+
+	while ((c = 2 * i + 1) < g->nheap)
+	{
+		if (c + 1 < g->nheap && g->heap[c + 1].time < g->heap[c].time)
+			c++;
+		if (last.time <= g->heap[c].time)
+			break;
+		g->heap[i] = g->heap[c];
+		i = c;
+	}
+	if (g->nheap > 0)
+		g->heap[i] = last;
+	return top;
+}
+
+/* When block b next does something: grows, then dies */
+static uint64_t next_time(const model_t *m, const block_t *b)
+{
+	if (b->life == FOREVER)
+		return FOREVER;
+	return b->born + (uint64_t)(b->life / pow(m->growth, b->grows));
+}
+
+/*
+ * Requests
+ */
+
+static void emit(gen_t *g, int type, uint32_t id, uint32_t size)
+{
+	traceop_t op;
+
+	g->ops++;
+	if (g->out == NULL)
+		return;
+	if (g->binary)
+	{
+		memset(&op, 0, sizeof(op));
+		op.type = type;
+		op.index = id;
+		op.size = size;
+		fwrite(&op, sizeof(op), 1, g->out);
+	}
+	else if (type == FREE)
+		fprintf(g->out, "f %u\n", id);
+	else
+		fprintf(g->out, "%c %u %u\n", type == ALLOC ? 'a' : 'r', id, size);
+}
+
+static void free_block(gen_t *g, uint32_t id)
+{
+	g->live -= g->blocks[id].size;
+	emit(g, FREE, id, 0);
+}
+
+static void new_block(const model_t *m, gen_t *g, uint64_t now, const dist_t *sizes)
+{
+	double kind = uniform01(g);
+	double size = sample(g, sizes);
+	uint32_t id = g->ids++;
+	block_t *b;
+
+	if (id >= g->maxblocks)
+	{
+		g->maxblocks = g->maxblocks ? 2 * g->maxblocks : 1024;
+		g->blocks = xrealloc(g->blocks, g->maxblocks * sizeof(block_t));
+	}
+	b = &g->blocks[id];
+	b->size = size < 1 ? 1 : (size > MAX_SIZE ? MAX_SIZE : (uint32_t)size);
+	b->born = now;
+	b->grows = 0;
+
+	/* Make room, sparing the block we're about to add */
+	while (g->live + b->size > m->live_target && g->nheap > 0)
+		free_block(g, pop_event(g).id);
+
+	if (kind <= m->cache_frac)
+		b->life = FOREVER;
+	else
+	{
+		b->life = (uint64_t)sample(g, &m->lifetimes) + 1;
+		if (kind <= m->cache_frac + m->vector_frac)
+			while (b->grows < MAX_GROWS &&
+				   b->size * pow(m->growth, b->grows + 1) <= m->vector_max)
+				b->grows++;
+	}
+
+	g->live += b->size;
+	if (g->live > g->peak)
+		g->peak = g->live;
+	emit(g, ALLOC, id, b->size);
+	push_event(g, next_time(m, b), id);
+}
+
+/*
+ * generate - one run of the model. Run once to count, since the header
+ * comes first, then again with the same seed to write.
+ */
+static void generate(const model_t *m, gen_t *g)
+{
+	uint64_t now;
+	int phase = 0;
+
+	g->rng = m->seed;
+	g->nheap = 0;
+	g->ops = g->ids = 0;
+	g->live = g->peak = 0;
+
+	for (now = 0; g->ops + (long)g->nheap < m->ops; now++)
+	{
+		while (phase + 1 < m->phases && m->phase_start[phase + 1] <= g->ops)
+			phase++;
+
+		if (g->nheap > 0 && g->heap[0].time <= now)
+		{
+			uint32_t id = pop_event(g).id;
+			block_t *b = &g->blocks[id];
+
+			if (b->grows == 0)
+			{
+				free_block(g, id);
+				continue;
+			}
+			g->live -= b->size;
+			b->size = (uint32_t)(b->size * m->growth);
+			b->grows--;
+			g->live += b->size;
+			if (g->live > g->peak)
+				g->peak = g->live;
+			emit(g, REALLOC, id, b->size);
+			push_event(g, next_time(m, b), id);
+		}
+		else if (g->ops + (long)g->nheap + 2 <= m->ops)
+			new_block(m, g, now, &m->sizes[phase]);
+		else if (g->nheap > 0)
+			free_block(g, pop_event(g).id);
+		else
+			break; /* one request short, with nothing live */
+	}
+
+	while (g->nheap > 0)
+		free_block(g, pop_event(g).id);
+}
+
+int main(int argc, char **argv)
+{
+	model_t m;
+	gen_t g;
+	char c;
+	char *colon;
+	uint64_t bytes;
+
+	memset(&m, 0, sizeof(m));
+	memset(&g, 0, sizeof(g));
+	m.ops = 100000;
+	m.live_target = 1 << 20;
+	parse_dist("lognormal:64:1", &m.sizes[0]);
+	m.phases = 1;
+	parse_dist("exp:1000", &m.lifetimes);
+	m.growth = 2;
+	m.vector_max = 1 << 20;
+	m.seed = 1;
+
+	while ((c = getopt(argc, argv, "bc:g:hl:m:n:r:S:s:t:v:")) != EOF)
+	{
+		switch (c)
+		{
+		case 'b':
+			g.binary = 1;
+			break;
+		case 'c':
+			m.cache_frac = atof(optarg);
+			break;
+		case 'g':
+			m.growth = atof(optarg);
+			break;
+		case 'l':
+			m.live_target = parse_bytes(optarg);
+			break;
+		case 'm':
+			bytes = parse_bytes(optarg);
+			m.vector_max = bytes > MAX_SIZE ? MAX_SIZE : bytes;
+			break;
+		case 'n':
+			m.ops = atol(optarg);
+			break;
+		case 'r':
+			m.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			if (!parse_dist(optarg, &m.sizes[0]))
+				app_error("bad size distribution");
+			break;
+		case 'S':
+			if (m.phases == MAX_PHASES)
+				app_error("too many size phases");
+			if ((colon = strchr(optarg, ':')) == NULL ||
+				!parse_dist(colon + 1, &m.sizes[m.phases]))
+				app_error("bad -S <ops>:<dist>");
+			m.phase_start[m.phases] = atol(optarg);
+			if (m.phase_start[m.phases] < m.phase_start[m.phases - 1])
+				app_error("-S phases must be in order");
+			m.phases++;
+			break;
+		case 't':
+			if (!parse_dist(optarg, &m.lifetimes))
+				app_error("bad lifetime distribution");
+			break;
+		case 'v':
+			m.vector_frac = atof(optarg);
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (optind != argc - 1)
+	{
+		usage();
+		exit(1);
+	}
+	if (m.growth <= 1)
+		app_error("the growth factor must be more than 1");
+	if (m.cache_frac < 0 || m.vector_frac < 0 || m.cache_frac + m.vector_frac > 1)
+		app_error("bad -c/-v fractions");
+
+	generate(&m, &g);
+	if (g.ids > (long)TRACE_MAX_IDS || g.ops > INT_MAX)
+		app_error("too many requests for a trace");
+
+	if ((g.out = fopen(argv[optind], g.binary ? "wb" : "w")) == NULL)
+		app_error("can't create the trace file");
+	if (g.binary)
+	{
+		trace_header_t hdr;
+		hdr.sugg_heapsize = g.peak > INT_MAX ? INT_MAX : (int32_t)g.peak;
+		hdr.num_ids = g.ids;
+		hdr.num_ops = g.ops;
+		hdr.weight = 1;
+		fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, g.out);
+		fwrite(&hdr, sizeof(hdr), 1, g.out);
+	}
+	else
+		fprintf(g.out, "%d\n%ld\n%ld\n1\n",
+				g.peak > INT_MAX ? INT_MAX : (int)g.peak, g.ids, g.ops);
+	generate(&m, &g);
+	if (fclose(g.out) != 0)
+		app_error("short write to the trace file");
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: mmgen [-bh] [-n <ops>] [-l <bytes>] [-s <dist>] [-S <ops>:<dist>]\n");
+	fprintf(stderr, "             [-t <dist>] [-c <frac>] [-v <frac>] [-g <factor>] [-m <bytes>]\n");
+	fprintf(stderr, "             [-r <seed>] <out>\n");
+	fprintf(stderr, "Options\n");
+	fprintf(stderr, "\t-b              Write the binary trace format.\n");
+	fprintf(stderr, "\t-c <frac>       Fraction of blocks that are cache entries (0).\n");
+	fprintf(stderr, "\t-g <factor>     Vector growth factor (2).\n");
+	fprintf(stderr, "\t-h              Print this message.\n");
+	fprintf(stderr, "\t-l <bytes>      Live bytes target (1M).\n");
+	fprintf(stderr, "\t-m <bytes>      Largest a vector grows (1M).\n");
+	fprintf(stderr, "\t-n <ops>        Requests to generate (100000).\n");
+	fprintf(stderr, "\t-r <seed>       Random seed (1).\n");
+	fprintf(stderr, "\t-s <dist>       Request sizes (lognormal:64:1).\n");
+	fprintf(stderr, "\t-S <ops>:<dist> Switch to these sizes after <ops> requests.\n");
+	fprintf(stderr, "\t-t <dist>       Block lifetimes in requests (exp:1000).\n");
+	fprintf(stderr, "\t-v <frac>       Fraction of blocks that are vectors (0).\n");
+	fprintf(stderr, "Distributions: fixed:<n> uniform:<lo>:<hi> exp:<mean>\n");
+	fprintf(stderr, "               lognormal:<median>:<sigma> pow2:<lo>:<hi>\n");
+}
@@ -0,0 +1,395 @@
+/*
+ * mmmerge.c - merge the per-thread logs written by the mmrecord shim
+ *     into one text (.rep) trace for mdriver.
+ *
+ * Usage: mmmerge <out.rep> <log>...
+ *
+ * The logs of one process are merged in sequence order, each block
+ * gets a fresh id when it is allocated and keeps it through reallocs,
+ * and blocks still live at the end are freed so the trace is balanced
+ * (as is one whose free was missed, when its address is reused).
+ * Frees of blocks the shim never saw allocated are dropped, zero byte
+ * requests become one byte ones (mdriver wants payloads) and requests
+ * too big for a trace are left out along with their block.
+ */
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define NO_ID UINT32_MAX
+
+/* One log, read in order */
+typedef struct
+{
+	callrec_t *recs;
+	size_t n;
+	size_t pos;
+	int released; /* the REALLOC at pos has given up its old block */
+	uint32_t id;  /* ... which had this id */
+} stream_t;
+
+/* Live blocks, open addressing on the address */
+typedef struct
+{
+	uint64_t ptr; /* 0 if empty */
+	uint32_t id;
+} slot_t;
+
+typedef struct
+{
+	long ops;
+	long ids;
+	long unknown;
+	long dropped;
+	long leaked;
+	uint64_t live;
+	uint64_t peak;
+} counts_t;
+
+static stream_t *streams;
+static int nstreams;
+static int *heap; /* streams not yet done, by next event */
+static int nheap;
+
+static slot_t *table;
+static size_t tableSize, tableUsed;
+static uint32_t *sizes; /* by id */
+static size_t sizesLen;
+
+static void die(const char *what, const char *path)
+{
+	fprintf(stderr, "mmmerge: %s %s\n", what, path);
+	exit(1);
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+	if ((p = realloc(p, size)) == NULL)
+		die("out of memory", "");
+	return p;
+}
+
+/*
+ * Stream heap
+ */
+
+static uint64_t next_seq(stream_t *s)
+{
+	callrec_t *r = &s->recs[s->pos];
+	return (r->type == REALLOC && !s->released) ? r->seq0 : r->seq;
+}
+
+static void sift_down(int i)
+{
+	for (;;)
+	{
+		int c = 2 * i + 1, t;
+		if (c >= nheap)
+			return;
+		if (c + 1 < nheap &&
+			next_seq(&streams[heap[c + 1]]) < next_seq(&streams[heap[c]]))
+			c++;
+		if (next_seq(&streams[heap[i]]) <= next_seq(&streams[heap[c]]))
+			return;
+		t = heap[i];
+		heap[i] = heap[c];
+		heap[c] = t;
+		i = c;
+	}
+}
+
+static void build_heap(void)
+{
+	int i;
+
+	nheap = 0;
+	for (i = 0; i < nstreams; i++)
+	{
+		streams[i].pos = 0;
+		streams[i].released = 0;
+		if (streams[i].n > 0)
+			heap[nheap++] = i;
+	}
+	for (i = nheap / 2 - 1; i >= 0; i--)
+		sift_down(i);
+}
+
+/*
+ * Live block table
+ */
+
+static size_t slot_of(uint64_t ptr)
+{
+	return ((ptr >> 4) * 0x9E3779B97F4A7C15ull) & (tableSize - 1);
+}
+
+static void put_block(uint64_t ptr, uint32_t id)
+{
+	size_t i;
+
+	if (2 * (tableUsed + 1) > tableSize)
+	{
+		slot_t *old = table;
+		size_t oldSize = tableSize;
+
+		tableSize = tableSize ? 2 * tableSize : 1024;
+		table = calloc(tableSize, sizeof(slot_t));
+		if (table == NULL)
+			die("out of memory", "");
+		for (i = 0; i < oldSize; i++)
+			if (old[i].ptr != 0)
+			{
+				size_t j = slot_of(old[i].ptr);
+				while (table[j].ptr != 0)
+					j = (j + 1) & (tableSize - 1);
+				table[j] = old[i];
+			}
+		free(old);
+	}
+
+	i = slot_of(ptr);
+	while (table[i].ptr != 0 && table[i].ptr != ptr)
+		i = (i + 1) & (tableSize - 1);
+	if (table[i].ptr == 0)
+		tableUsed++;
+	table[i].ptr = ptr;
+	table[i].id = id;
+}
+
+/* Remove ptr and return its id, or NO_ID if it isn't live */
+static uint32_t take_block(uint64_t ptr)
+{
+	size_t i, j, k;
+	uint32_t id;
+
+	if (tableSize == 0)
+		return NO_ID;
+	i = slot_of(ptr);
+	while (table[i].ptr != ptr)
+	{
+		if (table[i].ptr == 0)
+			return NO_ID;
+		i = (i + 1) & (tableSize - 1);
+	}
+	id = table[i].id;
+	tableUsed--;
+
+	/* Shift later members of the cluster back over the hole */
+	for (j = i;;)
+	{
+		table[i].ptr = 0;
+		do
+		{
+			j = (j + 1) & (tableSize - 1);
+			if (table[j].ptr == 0)
+				return id;
+			k = slot_of(table[j].ptr);
+		} while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+		table[i] = table[j];
+		i = j;
+	}
+}
+
+static uint32_t new_id(counts_t *c)
+{
+	if ((size_t)c->ids >= sizesLen)
+	{
+		sizesLen = sizesLen ? 2 * sizesLen : 1024;
+		sizes = xrealloc(sizes, sizesLen * sizeof(*sizes));
+	}
+	return c->ids++;
+}
+
+static void free_id(FILE *out, counts_t *c, uint32_t id)
+{
+	c->live -= sizes[id];
+	if (out)
+		fprintf(out, "f %u\n", id);
+	c->ops++;
+}
+
+/* Enter ptr as block id; one still there lost its free */
+static void live_block(FILE *out, counts_t *c, uint64_t ptr, uint32_t id,
+					   uint32_t size)
+{
+	uint32_t stale = take_block(ptr);
+
+	if (stale != NO_ID)
+		free_id(out, c, stale);
+	put_block(ptr, id);
+	sizes[id] = size;
+	c->live += size;
+	c->ops++;
+}
+
+static int cmp_id(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * merge - one pass over the logs. The first pass only counts, since
+ * the header comes first; the second writes the requests to out.
+ */
+static void merge(FILE *out, counts_t *c)
+{
+	uint32_t *ids;
+	size_t i, n;
+
+	memset(c, 0, sizeof(*c));
+	free(table);
+	table = NULL;
+	tableSize = tableUsed = 0;
+	build_heap();
+
+	while (nheap > 0)
+	{
+		stream_t *s = &streams[heap[0]];
+		callrec_t *r = &s->recs[s->pos];
+		uint32_t id, size = r->size ? r->size : 1;
+		int fits = r->size < INT_MAX;
+
+		switch (r->type)
+		{
+		case ALLOC:
+		case CALLOC:
+			if (!fits)
+			{
+				c->dropped++;
+				break;
+			}
+			id = new_id(c);
+			if (out)
+				fprintf(out, "%c %u %u\n", r->type == ALLOC ? 'a' : 'c', id, size);
+			live_block(out, c, r->ptr, id, size);
+			break;
+
+		case FREE:
+			if ((id = take_block(r->ptr)) == NO_ID)
+			{
+				c->unknown++;
+				break;
+			}
+			free_id(out, c, id);
+			break;
+
+		case REALLOC:
+			if (!s->released)
+			{
+				/* seq0: old stops being live, its id waits for seq */
+				s->id = take_block(r->old);
+				s->released = 1;
+				sift_down(0);
+				continue;
+			}
+			s->released = 0;
+			id = s->id;
+			if (!fits)
+			{
+				/* The block goes away with the request */
+				if (id != NO_ID)
+					free_id(out, c, id);
+				c->dropped++;
+				break;
+			}
+			if (id == NO_ID)
+			{
+				/* Never saw old allocated: start a block here */
+				id = new_id(c);
+				if (out)
+					fprintf(out, "a %u %u\n", id, size);
+			}
+			else
+			{
+				c->live -= sizes[id];
+				if (out)
+					fprintf(out, "r %u %u\n", id, size);
+			}
+			live_block(out, c, r->ptr, id, size);
+			break;
+
+		default:
+			die("bad record type in a log", "");
+		}
+
+		if (c->live > c->peak)
+			c->peak = c->live;
+		if (++s->pos == s->n)
+			heap[0] = heap[--nheap];
+		sift_down(0);
+	}
+
+	/* Balance the trace */
+	ids = xrealloc(NULL, (tableUsed + 1) * sizeof(*ids));
+	for (i = n = 0; i < tableSize; i++)
+		if (table[i].ptr != 0)
+			ids[n++] = table[i].id;
+	qsort(ids, n, sizeof(*ids), cmp_id);
+	for (i = 0; i < n; i++)
+		free_id(out, c, ids[i]);
+	c->leaked = n;
+	free(ids);
+}
+
+int main(int argc, char **argv)
+{
+	FILE *out;
+	counts_t c;
+	int i;
+
+	if (argc < 3)
+	{
+		fprintf(stderr, "Usage: mmmerge <out.rep> <log>...\n");
+		exit(1);
+	}
+
+	nstreams = argc - 2;
+	streams = xrealloc(NULL, nstreams * sizeof(*streams));
+	heap = xrealloc(NULL, nstreams * sizeof(*heap));
+	for (i = 0; i < nstreams; i++)
+	{
+		char *path = argv[i + 2];
+		struct stat st;
+		int fd;
+
+		if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+			die("can't open", path);
+		if (st.st_size % sizeof(callrec_t) != 0)
+			die("truncated log", path);
+		streams[i].n = st.st_size / sizeof(callrec_t);
+		streams[i].recs = NULL;
+		if (streams[i].n > 0 &&
+			(streams[i].recs = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+									fd, 0)) == MAP_FAILED)
+			die("can't map", path);
+		close(fd);
+	}
+
+	merge(NULL, &c);
+	if (c.ids > TRACE_MAX_IDS)
+		die("too many blocks for a trace from", argv[2]);
+
+	if ((out = fopen(argv[1], "w")) == NULL)
+		die("can't create", argv[1]);
+	fprintf(out, "%d\n%ld\n%ld\n1\n",
+			c.peak > INT_MAX ? INT_MAX : (int)c.peak, c.ids, c.ops);
+	merge(out, &c);
+	if (fclose(out) != 0)
+		die("short write to", argv[1]);
+
+	fprintf(stderr, "mmmerge: %ld requests on %ld blocks, peak %llu bytes live\n",
+			c.ops, c.ids, (unsigned long long)c.peak);
+	if (c.unknown || c.dropped || c.leaked)
+		fprintf(stderr, "mmmerge: skipped %ld frees of unknown blocks and "
+						"%ld oversized requests, freed %ld blocks at the end\n",
+				c.unknown, c.dropped, c.leaked);
+	return 0;
+}
@@ -0,0 +1,321 @@
+/*
+ * mmrecord.c - LD_PRELOAD shim that logs an unmodified program's
+ *     malloc, free, realloc and calloc calls, for mmmerge to turn into
+ *     a .rep trace.
+ *
+ * Usage: MMRECORD=<prefix> LD_PRELOAD=./libmmrecord.so <program> ...
+ *        ./mmmerge <out.rep> <prefix>.<pid>.*
+ *
+ * Each thread appends callrec_t records to its own buffer and writes
+ * it to <prefix>.<pid>.<n> (prefix "mmrecord" by default) whenever it
+ * fills, when the thread exits and when the process exits. The only
+ * shared write on the fast path is the atomic sequence number that
+ * mmmerge uses to put the threads back in order; giving blocks ids is
+ * left to mmmerge too. Calls made before the shim has found the real
+ * functions are served from a small static area and not logged, and
+ * neither are blocks from memalign and friends, so mmmerge skips frees
+ * of blocks it never saw allocated.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define LOG_RECORDS 4096 /* records buffered per thread */
+#define BOOTSTRAP 4096	 /* bytes for calls made while starting up */
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+
+/* One thread's buffer */
+typedef struct log
+{
+	struct log *next;
+	int fd; /* -1 until the first write */
+	int n;
+	callrec_t recs[LOG_RECORDS];
+} log_t;
+
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_realloc)(void *, size_t);
+static void *(*real_calloc)(size_t, size_t);
+
+static int initializing;
+static const char *prefix;
+static uint64_t seq;
+static int nlogs;
+
+/* Every live log, so the ones still buffered can be written at exit */
+static log_t *logs;
+static pthread_mutex_t logsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t logKey;
+
+static TLS log_t *mylog;
+static TLS int busy; /* inside the shim: don't log */
+
+static char bootstrap[BOOTSTRAP] __attribute__((aligned(16)));
+static size_t bootstrapUsed;
+
+static void init(void);
+static void *boot_alloc(size_t size);
+static void record(int type, uint64_t s, uint64_t s0, void *ptr,
+				   void *old, size_t size);
+
+/*
+ * Interposed functions
+ */
+
+void *malloc(size_t size)
+{
+	void *p;
+
+	if (real_malloc == NULL)
+	{
+		if (initializing)
+			return boot_alloc(size);
+		init();
+	}
+	p = real_malloc(size);
+	if (p != NULL && !busy)
+		record(ALLOC, __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED), 0,
+			   p, NULL, size);
+	return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	void *p;
+
+	if (real_calloc == NULL)
+	{
+		if (initializing)
+			return boot_alloc(nmemb * size);
+		init();
+	}
+	p = real_calloc(nmemb, size);
+	if (p != NULL && !busy)
+		record(CALLOC, __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED), 0,
+			   p, NULL, nmemb * size);
+	return p;
+}
+
+void free(void *ptr)
+{
+	if (ptr == NULL ||
+		((char *)ptr >= bootstrap && (char *)ptr < bootstrap + BOOTSTRAP))
+		return;
+	if (real_free == NULL)
+	{
+		init();
+		if (real_free == NULL)
+			return;
+	}
+	if (!busy)
+		record(FREE, __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED), 0,
+			   ptr, NULL, 0);
+	real_free(ptr);
+}
+
+void *realloc(void *old, size_t size)
+{
+	uint64_t s0;
+	void *p;
+
+	if (old == NULL)
+		return malloc(size);
+	if ((char *)old >= bootstrap && (char *)old < bootstrap + BOOTSTRAP)
+	{
+		if ((p = malloc(size)) != NULL)
+		{
+			size_t avail = bootstrap + BOOTSTRAP - (char *)old;
+			memcpy(p, old, size < avail ? size : avail);
+		}
+		return p;
+	}
+	if (real_realloc == NULL)
+		init();
+	if (busy)
+		return real_realloc(old, size);
+
+	s0 = __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED);
+	p = real_realloc(old, size);
+	if (p != NULL)
+		record(REALLOC, __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED), s0,
+			   p, old, size);
+	else if (size == 0) /* glibc frees old */
+		record(FREE, s0, 0, old, NULL, 0);
+	return p;
+}
+
+/*
+ * Logging
+ */
+
+static void write_log(log_t *l)
+{
+	char path[4096];
+	char *buf = (char *)l->recs;
+	size_t len = l->n * sizeof(callrec_t);
+	ssize_t done;
+
+	if (l->n == 0)
+		return;
+	if (l->fd < 0)
+	{
+		snprintf(path, sizeof(path), "%s.%d.%d", prefix, (int)getpid(),
+				 __atomic_fetch_add(&nlogs, 1, __ATOMIC_RELAXED));
+		if ((l->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		{
+			l->n = 0;
+			return;
+		}
+	}
+	while (len > 0 && (done = write(l->fd, buf, len)) > 0)
+	{
+		buf += done;
+		len -= done;
+	}
+	l->n = 0;
+}
+
+static void record(int type, uint64_t s, uint64_t s0, void *ptr,
+				   void *old, size_t size)
+{
+	log_t *l = mylog;
+	callrec_t *r;
+
+	if (l == NULL)
+	{
+		busy++;
+		l = mmap(NULL, sizeof(log_t), PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (l == MAP_FAILED)
+		{
+			busy--;
+			return;
+		}
+		l->fd = -1;
+		pthread_mutex_lock(&logsLock);
+		l->next = logs;
+		logs = l;
+		pthread_mutex_unlock(&logsLock);
+		pthread_setspecific(logKey, l);
+		mylog = l;
+		busy--;
+	}
+
+	r = &l->recs[l->n];
+	r->seq = s;
+	r->seq0 = s0;
+	r->ptr = (uint64_t)ptr;
+	r->old = (uint64_t)old;
+	r->size = size;
+	r->type = type;
+	if (++l->n == LOG_RECORDS)
+		write_log(l);
+}
+
+/* pthread key destructor: write and drop an exiting thread's log */
+static void thread_exit(void *arg)
+{
+	log_t *l = arg, **pp;
+
+	write_log(l);
+	if (l->fd >= 0)
+		close(l->fd);
+	pthread_mutex_lock(&logsLock);
+	for (pp = &logs; *pp != l; pp = &(*pp)->next)
+		;
+	*pp = l->next;
+	pthread_mutex_unlock(&logsLock);
+	mylog = NULL;
+	munmap(l, sizeof(log_t));
+}
+
+/*
+ * fork: the child starts its own files, and inherits none of the
+ * parent's buffered records or other threads
+ */
+static void before_fork(void)
+{
+	pthread_mutex_lock(&logsLock);
+}
+
+static void after_fork_parent(void)
+{
+	pthread_mutex_unlock(&logsLock);
+}
+
+static void after_fork_child(void)
+{
+	logs = mylog;
+	if (mylog != NULL)
+	{
+		mylog->next = NULL;
+		mylog->n = 0;
+		if (mylog->fd >= 0)
+			close(mylog->fd);
+		mylog->fd = -1;
+	}
+	nlogs = 0;
+	pthread_mutex_unlock(&logsLock);
+}
+
+/* dlsym allocates while init() is looking the functions up */
+static void *boot_alloc(size_t size)
+{
+	char *p = bootstrap + bootstrapUsed;
+
+	size = (size + 15) & ~(size_t)15;
+	if (size > BOOTSTRAP - bootstrapUsed)
+		return NULL;
+	bootstrapUsed += size;
+	return p;
+}
+
+/*
+ * init - find the real functions. Runs on the first call into the
+ * shim, which may come before the constructor.
+ */
+static void init(void)
+{
+	if (initializing || real_malloc != NULL)
+		return;
+	initializing = 1;
+	busy++;
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	if ((prefix = getenv("MMRECORD")) == NULL)
+		prefix = "mmrecord";
+	pthread_key_create(&logKey, thread_exit);
+	pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+	busy--;
+	initializing = 0;
+}
+
+__attribute__((constructor)) static void start(void)
+{
+	init();
+}
+
+/* Threads still running at exit lose what they log after this */
+__attribute__((destructor)) static void finish(void)
+{
+	log_t *l;
+
+	busy++;
+	pthread_mutex_lock(&logsLock);
+	for (l = logs; l != NULL; l = l->next)
+		write_log(l);
+	pthread_mutex_unlock(&logsLock);
+	busy--;
+}
@@ -0,0 +1,115 @@
+/*
+ * rep2bin.c - convert a text (.rep) malloc lab trace to the binary
+ *     format of trace.h, which mdriver maps instead of parsing.
+ *
+ * Usage: rep2bin <in.rep> <out>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+static void die(const char *what, const char *path)
+{
+	fprintf(stderr, "rep2bin: %s %s\n", what, path);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in, *out;
+	trace_header_t hdr;
+	traceop_t op;
+	char type[16];
+	unsigned index, size, align, batch, k;
+	int n = 0;
+
+	if (argc != 3)
+	{
+		fprintf(stderr, "Usage: rep2bin <in.rep> <out>\n");
+		exit(1);
+	}
+	if ((in = fopen(argv[1], "r")) == NULL)
+		die("can't open", argv[1]);
+	if ((out = fopen(argv[2], "wb")) == NULL)
+		die("can't create", argv[2]);
+
+	if (fscanf(in, "%d %d %d %d", &hdr.sugg_heapsize, &hdr.num_ids,
+			   &hdr.num_ops, &hdr.weight) != 4)
+		die("bad header in", argv[1]);
+	if ((unsigned)hdr.num_ids > TRACE_MAX_IDS)
+		die("too many ids for the binary format in", argv[1]);
+	fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, out);
+	fwrite(&hdr, sizeof(hdr), 1, out);
+
+	while (fscanf(in, "%15s", type) == 1)
+	{
+		memset(&op, 0, sizeof(op));
+		batch = 1;
+		switch (type[0])
+		{
+		case 'a':
+		case 'r':
+			if (fscanf(in, "%u %u", &index, &size) != 2)
+				die("bad request in", argv[1]);
+			op.type = (type[0] == 'a') ? ALLOC : REALLOC;
+			op.size = size;
+			break;
+		case 'f':
+			if (fscanf(in, "%u", &index) != 1)
+				die("bad request in", argv[1]);
+			op.type = FREE;
+			break;
+		case 's':
+			if (fscanf(in, "%u %u", &index, &size) != 2)
+				die("bad request in", argv[1]);
+			op.type = FREE_SIZED;
+			op.size = size;
+			break;
+		case 'm':
+			if (fscanf(in, "%u %u %u", &index, &align, &size) != 3)
+				die("bad request in", argv[1]);
+			if (align == 0 || (align & (align - 1)) != 0 || size >= 1u << TRACE_ALIGN_SHIFT)
+				die("bad memalign in", argv[1]);
+			op.type = MEMALIGN;
+			op.size = size | __builtin_ctz(align) << TRACE_ALIGN_SHIFT;
+			break;
+		case 'c':
+			if (fscanf(in, "%u %u", &index, &size) != 2)
+				die("bad request in", argv[1]);
+			op.type = CALLOC;
+			op.size = size;
+			break;
+		case 'A':
+		case 'F':
+			/* One request per block; the ids are read below */
+			if (fscanf(in, "%u", &batch) != 1 || batch == 0 ||
+				(type[0] == 'A' && fscanf(in, "%u", &size) != 1))
+				die("bad batch in", argv[1]);
+			op.type = (type[0] == 'A') ? ALLOC_BATCH : FREE_BATCH;
+			op.size = (type[0] == 'A') ? size : 0;
+			break;
+		default:
+			die("bogus request type in", argv[1]);
+		}
+		for (k = 0; k < batch; k++)
+		{
+			if ((type[0] == 'A' || type[0] == 'F') && fscanf(in, "%u", &index) != 1)
+				die("bad batch in", argv[1]);
+			if (index >= (unsigned)hdr.num_ids)
+				die("id out of range in", argv[1]);
+			op.more = (k > 0);
+			op.index = index;
+			fwrite(&op, sizeof(op), 1, out);
+			n++;
+		}
+	}
+	fclose(in);
+
+	if (n != hdr.num_ops)
+		die("request count doesn't match the header in", argv[1]);
+	if (fclose(out) != 0)
+		die("short write to", argv[2]);
+	return 0;
+}
@@ -0,0 +1,97 @@
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+/*
+ * trace.h - the two formats of a malloc lab trace
+ *
+ * Text (.rep): the suggested heap size, the number of block ids, the
+ * number of requests and a weight, then one request per line:
+ * "a <id> <size>", "r <id> <size>" or "f <id>". Traces for the mm
+ * package's other calls also have "s <id> <size>", a free that passes
+ * the size the block was last given, "A <n> <size> <id>...", n blocks
+ * allocated with one mm_malloc_batch, "F <n> <id>...", n blocks
+ * freed with one mm_free_batch, "m <id> <align> <size>", an mm_memalign
+ * to a power of two, and "c <id> <size>", an mm_calloc. A batch counts
+ * as n requests.
+ *
+ * Binary: TRACE_MAGIC, a trace_header_t and then num_ops traceop_t
+ * records, all little endian. The records are laid out exactly as
+ * mdriver holds requests in memory (the SysV ABI allocates bit-fields
+ * from the low bit up), so mdriver maps a binary trace and uses it as
+ * is. rep2bin converts from text.
+ *
+ * Recorded: the mmrecord shim logs a running program's calls as
+ * callrec_t records, one file per thread, and mmmerge turns the files
+ * into a text trace.
+ */
+#include <stdint.h>
+
+#define TRACE_MAGIC "MMTRACE1"
+#define TRACE_MAGIC_LEN 8
+
+/* Kinds of request */
+typedef enum
+{
+	ALLOC,
+	FREE,
+	REALLOC,
+	FREE_SIZED,
+	ALLOC_BATCH,
+	FREE_BATCH,
+	MEMALIGN,
+	CALLOC
+} RequestType;
+#define REQUEST_TYPES 8
+
+#define TRACE_MAX_IDS (1u << 28)
+
+/*
+ * One request, 8 bytes. A batch is one request per block, in a row,
+ * with more set on all but the first.
+ */
+typedef struct
+{
+	uint32_t type : 3;	 /* RequestType */
+	uint32_t more : 1;	 /* continues the batch of the request before */
+	uint32_t index : 28; /* block id */
+	uint32_t size;		 /* byte size of the request, or of a sized free */
+} traceop_t;
+
+/*
+ * A MEMALIGN request keeps log2 of its alignment in the top bits of
+ * size, which leaves it sizes below 1 << TRACE_ALIGN_SHIFT
+ */
+#define TRACE_ALIGN_SHIFT 27
+#define TRACE_SIZE(op) \
+	((op).type == MEMALIGN ? (op).size & ((1u << TRACE_ALIGN_SHIFT) - 1) : (op).size)
+#define TRACE_ALIGN(op) \
+	((op).type == MEMALIGN ? 1u << ((op).size >> TRACE_ALIGN_SHIFT) : 1u)
+
+/* Follows the magic in a binary trace */
+typedef struct
+{
+	int32_t sugg_heapsize;
+	int32_t num_ids;
+	int32_t num_ops;
+	int32_t weight;
+} trace_header_t;
+
+/*
+ * One call logged by mmrecord. seq orders the calls of all threads:
+ * an ALLOC or REALLOC takes it after the block is handed out and a FREE
+ * before the block is given back, so no block is seen being reused
+ * before it is freed. A REALLOC also takes seq0 before the call, which
+ * is when old stops being live: it can be handed to another thread
+ * before seq is taken.
+ */
+typedef struct
+{
+	uint64_t seq;
+	uint64_t seq0;
+	uint64_t ptr;  /* block returned, or freed */
+	uint64_t old;  /* REALLOC: block passed in */
+	uint64_t size; /* bytes asked for */
+	uint64_t type; /* RequestType */
+} callrec_t;
+
+#endif /* __TRACE_H_ */